@@ -34,6 +34,7 @@ extern zend_class_entry *ce_can_Exception,
     *ce_can_HTTPError;
 
 int php_can_throw_exception(zend_class_entry *ce TSRMLS_DC, char *format, ...);
+int php_can_throw_exception_code(zend_class_entry *ce TSRMLS_DC, long code, char *format, ...);
 
 PHP_MINIT_FUNCTION(can_exception);
 PHP_MSHUTDOWN_FUNCTION(can_exception);
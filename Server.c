@@ -30,10 +30,16 @@
 static zend_bool request_counter_used = 0;
 static long request_counter = 0;
 
+/**
+ * Servers by their evhttp handle and request objects created when request
+ * headers arrived, but not yet passed to the request_handler
+ */
+static HashTable servers;
+static HashTable pending_requests;
+
 zend_class_entry *ce_can_server;
 static zend_object_handlers server_obj_handlers;
 
-void php_can_parse_multipart(const char* content_type, struct evbuffer* buffer, zval* post, zval** files TSRMLS_DC);
 static void server_dtor(void *object TSRMLS_DC);
 
 static zend_object_value server_ctor(zend_class_entry *ce TSRMLS_DC)
@@ -89,177 +95,96 @@ static void server_dtor(void *object TSRMLS_DC)
 }
 
 /**
- * Remove null byte from any string value
+ * Create request object for the given libevent request
  */
-static int cleanUp(zval **item TSRMLS_DC)
-{
-    /* TODO: do we need stripslashes in PHP 5.4+ ?
-    if (Z_TYPE_PP(item) == IS_STRING) {
-        char *str = estrndup(Z_STRVAL_PP(item), Z_STRLEN_PP(item));
-        int str_len = Z_STRLEN_PP(item);
-        php_stripslashes(str, &str_len TSRMLS_CC);
-        efree(Z_STRVAL_PP(item));
-        Z_STRVAL_PP(item) = estrndup(str, str_len);
-        Z_STRLEN_PP(item) = str_len;
-        efree(str);
-    }
-    */
-    if (Z_TYPE_PP(item) == IS_STRING) {
-        int new_value_len, count = 0;
-        char *new_value = php_str_to_str_ex(Z_STRVAL_PP(item), Z_STRLEN_PP(item), 
-                "\0", 1, "", 0, &new_value_len, 0, &count);
-        if (count > 0) {
-            efree(Z_STRVAL_PP(item));
-            Z_STRVAL_PP(item) = estrndup(new_value, new_value_len);
-            Z_STRLEN_PP(item) = new_value_len;
-        }
-        efree(new_value);
-    }
-
-    return ZEND_HASH_APPLY_KEEP;
-}
-
-static void parse_cookies(const char *cookie, zval **array_ptr TSRMLS_DC)
+static zval * request_new(struct evhttp_request *req TSRMLS_DC)
 {
-    char *str, *var, *val, *strtok_buf = NULL;
-    str = (char *) estrdup(cookie);
-    var = php_strtok_r(str, ";\0", &strtok_buf);
-    while (var) {
-
-        val = strchr(var, '=');
-
-        /* Remove leading spaces from cookie names,
-           needed for multi-cookie header where ; can be
-           followed by a space */
-        while (isspace(*var)) {
-            var++;
-        }
-
-        if (var == val || *var == '\0') {
-            goto next_cookie;
-        }
-
-        if (val) { /* have a value */
-            int val_len;
-            unsigned int new_val_len;
-
-            *val++ = '\0';
-            php_url_decode(var, strlen(var));
-            val_len = php_url_decode(val, strlen(val));
-            val = estrndup(val, val_len);
-            add_assoc_stringl(*array_ptr, var, val, val_len, 1);
-            efree(val);
-        } else {
-            int val_len;
-            unsigned int new_val_len;
-
-            php_url_decode(var, strlen(var));
-            val_len = 0;
-            val = STR_EMPTY_ALLOC();
-            add_assoc_stringl(*array_ptr, var, val, val_len, 1);
-            efree(val);
-        }
-next_cookie:
-        var = php_strtok_r(NULL, ";\0", &strtok_buf);
-    }
-
-    efree(str);
-}
-
-static void request_handler(struct evhttp_request *req, void *arg)
-{
-    TSRMLS_FETCH();
-
-    if (request_counter_used) { 
-        request_counter++;
-    }
-
-    zval *zrequest, *args[2];
-    struct php_can_server *server = (struct php_can_server*)arg;
+    zval *zrequest;
     struct php_can_server_request *request;
-    struct php_can_server_router *router;
-    struct php_can_server_route *route = NULL;
-    const char *cookie = NULL, *content_type = NULL, *content_length = NULL;
-    long content_len = 0, buffer_len = 0;
-    zval retval, *params;
     struct timeval tp = {0};
-    long routeIndex = -1;
-    
-    struct evbuffer *buffer = evbuffer_new();
-    
-    // create request object
+
     MAKE_STD_ZVAL(zrequest);
     object_init_ex(zrequest, ce_can_server_request);
     Z_SET_REFCOUNT_P(zrequest, 1);
     request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
     request->req = req;
-    
+
     // set request time
     if(gettimeofday(&tp, NULL) == 0 ) {
         request->time = (double)(tp.tv_sec + tp.tv_usec / 1000000.00);
     }
 
-    const char * uri_path = evhttp_uri_get_path(req->uri_elems);
-    if (uri_path == NULL) {
-        // Bad request
-        request->response_status = 400;
-        spprintf(&request->error, 0, "Cannot determine path of the uri");
-        
+    return zrequest;
+}
+
+/**
+ * Translate uncaught exception into the response status and error of the request
+ */
+static void request_exception(struct php_can_server_request *request TSRMLS_DC)
+{
+    if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPError TSRMLS_CC)) {
+        zval *code = NULL, *error = NULL;
+        code  = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "code", sizeof("code")-1, 1 TSRMLS_CC);
+        error = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "message", sizeof("message")-1, 1 TSRMLS_CC);
+        request->response_status = code ? Z_LVAL_P(code) : 500;
+        spprintf(&request->error, 0, "%s", error ? Z_STRVAL_P(error) : "Unknown");
     } else {
+        zval *file = NULL, *line = NULL, *error = NULL;
+        file = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "file", sizeof("file")-1, 1 TSRMLS_CC);
+        line = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "line", sizeof("line")-1, 1 TSRMLS_CC);
+        request->response_status = 500;
+        spprintf(&request->error, 0, "Uncaught exception '%s' within request handler thrown in %s on line %d %s", 
+                Z_OBJCE_P(EG(exception))->name,
+                file ? Z_STRVAL_P(file) : NULL,
+                line ? (int)Z_LVAL_P(line) : 0,
+                error ? Z_STRVAL_P(error) : ""
+        );
+    }
+    zend_clear_exception(TSRMLS_C);
+}
 
-        MAKE_STD_ZVAL(params);
-        array_init(params);
-        
-        // try to find route handler
-        router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
-        char *method = php_can_method_name(req->type);
-        zval **method_routes;
-        if (FAILURE != zend_hash_find(Z_ARRVAL_P(router->method_routes), method, strlen(method) + 1, (void **)&method_routes)) {
-            zval **item;
-            if (FAILURE != zend_hash_find(Z_ARRVAL_PP(method_routes), uri_path, strlen(uri_path) + 1, (void **)&item)) {
-                // static route
-                routeIndex = Z_LVAL_PP(item);
-            } else {
-                // dynamic routes, apply regexp to the URI
-                PHP_CAN_FOREACH(*method_routes, item) {
-                    if (strkey[0] == '\1') {
-                        pcre_cache_entry *pce;
-                        // TODO: cache compiled pce
-                        if (NULL != (pce = pcre_get_compiled_regex_cache(strkey, strlen(strkey) TSRMLS_CC))) {
-                            zval *subpats = NULL;
-                            zval *res = NULL;
-                            ALLOC_INIT_ZVAL(subpats);
-                            ALLOC_INIT_ZVAL(res);
-                            php_pcre_match_impl(pce, (char *)uri_path, strlen(uri_path), res, subpats, 0, 0, 0, 0 TSRMLS_CC);
-                            if(Z_LVAL_P(res) > 0) {
-                                routeIndex = Z_LVAL_PP(item);
-                                zval **match;
-                                PHP_CAN_FOREACH(subpats, match) {
-                                    if (keytype == HASH_KEY_IS_STRING) {
-                                        char * param = estrndup(Z_STRVAL_PP(match), Z_STRLEN_PP(match));
-                                        int param_len = php_url_decode(param, Z_STRLEN_PP(match));
-                                        add_assoc_stringl(params, strkey, param, param_len, 0);
-                                    }
-                                }
-                            }
-                            zval_ptr_dtor(&subpats);
-                            zval_ptr_dtor(&res);
-                            if (routeIndex >= 0) {
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+/**
+ * Map request method to the Route::METHOD_* flag
+ */
+static int request_method_flag(int type)
+{
+    switch (type) {
+        case EVHTTP_REQ_GET: return PHP_CAN_SERVER_ROUTE_METHOD_GET;
+        case EVHTTP_REQ_POST: return PHP_CAN_SERVER_ROUTE_METHOD_POST;
+        case EVHTTP_REQ_HEAD: return PHP_CAN_SERVER_ROUTE_METHOD_HEAD;
+        case EVHTTP_REQ_PUT: return PHP_CAN_SERVER_ROUTE_METHOD_PUT;
+        case EVHTTP_REQ_DELETE: return PHP_CAN_SERVER_ROUTE_METHOD_DELETE;
+        case EVHTTP_REQ_OPTIONS: return PHP_CAN_SERVER_ROUTE_METHOD_OPTIONS;
+        case EVHTTP_REQ_TRACE: return PHP_CAN_SERVER_ROUTE_METHOD_TRACE;
+        case EVHTTP_REQ_CONNECT: return PHP_CAN_SERVER_ROUTE_METHOD_CONNECT;
+        case EVHTTP_REQ_PATCH: return PHP_CAN_SERVER_ROUTE_METHOD_PATCH;
+        default: return 0;
+    }
+}
+
+/**
+ * Find route for the given path, on success route index is returned and
+ * named subpatterns of the route are added to params, otherwise -1 is returned
+ * and status is set to 404 or 405
+ */
+static long find_route(struct php_can_server *server, struct evhttp_request *req, 
+        const char *uri_path, zval *params, long *status TSRMLS_DC)
+{
+    struct php_can_server_router *router;
+    long routeIndex = -1;
 
-        zval **zroute;
-        if (routeIndex == -1 || FAILURE == zend_hash_index_find(Z_ARRVAL_P(router->routes), routeIndex, (void **)&zroute)) {
-            // there is definitely no such route for requested HTTP method
-            // we search through route_methods to determine what HTTP response we send back
-            zval **item;
-            zend_bool found = 0;
-            PHP_CAN_FOREACH(router->route_methods, item) {
+    // try to find route handler
+    router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
+    char *method = php_can_method_name(req->type);
+    zval **method_routes;
+    if (FAILURE != zend_hash_find(Z_ARRVAL_P(router->method_routes), method, strlen(method) + 1, (void **)&method_routes)) {
+        zval **item;
+        if (FAILURE != zend_hash_find(Z_ARRVAL_PP(method_routes), uri_path, strlen(uri_path) + 1, (void **)&item)) {
+            // static route
+            routeIndex = Z_LVAL_PP(item);
+        } else {
+            // dynamic routes, apply regexp to the URI
+            PHP_CAN_FOREACH(*method_routes, item) {
                 if (strkey[0] == '\1') {
                     pcre_cache_entry *pce;
                     // TODO: cache compiled pce
@@ -270,193 +195,635 @@ static void request_handler(struct evhttp_request *req, void *arg)
                         ALLOC_INIT_ZVAL(res);
                         php_pcre_match_impl(pce, (char *)uri_path, strlen(uri_path), res, subpats, 0, 0, 0, 0 TSRMLS_CC);
                         if(Z_LVAL_P(res) > 0) {
-                            // route exists, so we send 405
-                            found = 1;
+                            routeIndex = Z_LVAL_PP(item);
+                            zval **match;
+                            PHP_CAN_FOREACH(subpats, match) {
+                                if (keytype == HASH_KEY_IS_STRING) {
+                                    char * param = estrndup(Z_STRVAL_PP(match), Z_STRLEN_PP(match));
+                                    int param_len = php_url_decode(param, Z_STRLEN_PP(match));
+                                    add_assoc_stringl(params, strkey, param, param_len, 0);
+                                }
+                            }
                         }
                         zval_ptr_dtor(&subpats);
                         zval_ptr_dtor(&res);
-                        if (found) {
+                        if (routeIndex >= 0) {
                             break;
                         }
                     }
                 }
             }
-            request->response_status = found ? 405 : 404;
-            spprintf(&request->error, 0, "Cannot determine route for the path '%s'", uri_path);
-            
-        } else {
+        }
+    }
 
-            // set route
-            route = (struct php_can_server_route *)zend_object_store_get_object(*zroute TSRMLS_CC);
-            
-            // check if we must cast params
-            if (zend_hash_num_elements(Z_ARRVAL_P(route->casts))) {
-                zval **item, **param;
-                PHP_CAN_FOREACH(route->casts, item) {
-                    if (FAILURE != zend_hash_find(Z_ARRVAL_P(params), strkey, strlen(strkey) + 1, (void **)&param)) {
-                        if (Z_LVAL_PP(item) == IS_LONG) {
-                            convert_to_long_ex(param);
-                        } else if (Z_LVAL_PP(item) == IS_DOUBLE) {
-                            convert_to_double_ex(param);
-                        } else if (Z_LVAL_PP(item) == IS_PATH) {
-                            if (CHECK_ZVAL_NULL_PATH(*param)) {
-                                request->response_status = 400;
-                                spprintf(&request->error, 0, "Detected invalid characters in the URI.");
-                                break;
-                            }
-                        }
+    if (routeIndex == -1 || !zend_hash_index_exists(Z_ARRVAL_P(router->routes), routeIndex)) {
+        // there is definitely no such route for requested HTTP method
+        // we search through route_methods to determine what HTTP response we send back
+        zval **item;
+        zend_bool found = 0;
+        PHP_CAN_FOREACH(router->route_methods, item) {
+            if (strkey[0] == '\1') {
+                pcre_cache_entry *pce;
+                // TODO: cache compiled pce
+                if (NULL != (pce = pcre_get_compiled_regex_cache(strkey, strlen(strkey) TSRMLS_CC))) {
+                    zval *subpats = NULL;
+                    zval *res = NULL;
+                    ALLOC_INIT_ZVAL(subpats);
+                    ALLOC_INIT_ZVAL(res);
+                    php_pcre_match_impl(pce, (char *)uri_path, strlen(uri_path), res, subpats, 0, 0, 0, 0 TSRMLS_CC);
+                    if(Z_LVAL_P(res) > 0) {
+                        // route exists, so we send 405
+                        found = 1;
+                    }
+                    zval_ptr_dtor(&subpats);
+                    zval_ptr_dtor(&res);
+                    if (found) {
+                        break;
                     }
-                }    
+                }
             }
+        }
+        *status = found ? 405 : 404;
+        return -1;
+    }
 
-            // parse cookies
-            cookie = evhttp_find_header(request->req->input_headers, "Cookie");
-            if (cookie != NULL) {
-                MAKE_STD_ZVAL(request->cookies);
-                array_init(request->cookies);
-                parse_cookies(cookie, &request->cookies TSRMLS_CC);
-                // remove null bytes from cookies
-                zend_hash_apply(Z_ARRVAL_P(request->cookies), (apply_func_t) cleanUp TSRMLS_CC);
-            }
+    return routeIndex;
+}
 
-            // set query and parse GET parameters
-            request->uri = estrdup(uri_path);
-            const char *query = evhttp_uri_get_query(req->uri_elems);
-            if (query != NULL) {
-                request->query = estrdup(query);
-                MAKE_STD_ZVAL(request->get);
-                array_init(request->get);
-                char *q = estrdup(query); // will be freed within php_default_treat_data()
-                php_default_treat_data(PARSE_STRING, q, request->get TSRMLS_CC);
-                // remove null bytes from get params
-                zend_hash_apply(Z_ARRVAL_P(request->get), (apply_func_t) cleanUp TSRMLS_CC);
-            }
+/**
+ * Resolve route of the request and validate route params
+ */
+static void route_request(struct php_can_server *server, struct php_can_server_request *request TSRMLS_DC)
+{
+    struct evhttp_request *req = request->req;
+    struct php_can_server_router *router;
+    struct php_can_server_route *route;
+    zval **zroute;
+    long routeIndex;
+
+    const char * uri_path = evhttp_uri_get_path(req->uri_elems);
+    if (uri_path == NULL) {
+        // Bad request
+        request->response_status = 400;
+        spprintf(&request->error, 0, "Cannot determine path of the uri");
+        return;
+    }
 
-            // parse POST parameters
-            if (request->req->type == EVHTTP_REQ_POST) {
+    MAKE_STD_ZVAL(request->params);
+    array_init(request->params);
 
-                buffer_len = EVBUFFER_LENGTH(request->req->input_buffer);
-                content_length = evhttp_find_header(request->req->input_headers, "Content-Length");
-                if (content_length != NULL) {
-                    content_len = atol(content_length);
+    routeIndex = find_route(server, req, uri_path, request->params, &request->response_status TSRMLS_CC);
+    router = (struct php_can_server_router *)zend_object_store_get_object(server->router TSRMLS_CC);
+    if (routeIndex == -1 || FAILURE == zend_hash_index_find(Z_ARRVAL_P(router->routes), routeIndex, (void **)&zroute)) {
+        spprintf(&request->error, 0, "Cannot determine route for the path '%s'", uri_path);
+        return;
+    }
+
+    // set route
+    zval_add_ref(zroute);
+    request->route = *zroute;
+    route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+
+    // check if we must cast params
+    if (zend_hash_num_elements(Z_ARRVAL_P(route->casts))) {
+        zval **item, **param;
+        PHP_CAN_FOREACH(route->casts, item) {
+            if (FAILURE != zend_hash_find(Z_ARRVAL_P(request->params), strkey, strlen(strkey) + 1, (void **)&param)) {
+                if (Z_LVAL_PP(item) == IS_LONG) {
+                    convert_to_long_ex(param);
+                } else if (Z_LVAL_PP(item) == IS_DOUBLE) {
+                    convert_to_double_ex(param);
+                } else if (Z_LVAL_PP(item) == IS_PATH) {
+                    if (CHECK_ZVAL_NULL_PATH(*param)) {
+                        request->response_status = 400;
+                        spprintf(&request->error, 0, "Detected invalid characters in the URI.");
+                        break;
+                    }
                 }
+            }
+        }    
+    }
+
+    // set query
+    request->uri = estrdup(uri_path);
+    const char *query = evhttp_uri_get_query(req->uri_elems);
+    if (query != NULL) {
+        request->query = estrdup(query);
+    }
+}
+
+/**
+ * Pass request body received so far to the body handler of the route and drain it
+ */
+static void request_body(zval *zrequest, struct evbuffer *buffer TSRMLS_DC)
+{
+    struct php_can_server_request *request;
+    struct php_can_server_route *route;
+    size_t len = evbuffer_get_length(buffer);
+
+    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+
+    if (len == 0 || request->route == NULL || request->response_status != 0) {
+        // nobody is interested in this chunk
+        evbuffer_drain(buffer, len);
+        return;
+    }
+
+    route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+    request->body_len += len;
+
+    zval retval, *chunk, *args[2];
+    MAKE_STD_ZVAL(chunk);
+    Z_TYPE_P(chunk) = IS_STRING;
+    Z_STRLEN_P(chunk) = len;
+    Z_STRVAL_P(chunk) = emalloc(len + 1);
+    evbuffer_remove(buffer, Z_STRVAL_P(chunk), len);
+    Z_STRVAL_P(chunk)[len] = '\0';
+
+    args[0] = zrequest;
+    args[1] = chunk;
+
+    if (call_user_function(EG(function_table), NULL, route->body_handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+        zval_dtor(&retval);
+    }
+    zval_ptr_dtor(&chunk);
+
+    if (EG(exception)) {
+        request_exception(request TSRMLS_CC);
+    }
+}
+
+/**
+ * Report body upload progress to the progress handler of the route, handler is
+ * called once per progress interval and when the body is complete
+ */
+static void request_progress(zval *zrequest, long received, int complete TSRMLS_DC)
+{
+    struct php_can_server_request *request;
+    struct php_can_server_route *route;
+    const char *content_length;
+
+    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+    if (request->route == NULL || request->response_status != 0) {
+        return;
+    }
+
+    route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+    if (route->progress_handler == NULL 
+            || received == request->progress_len 
+            || (!complete && received - request->progress_len < route->progress_interval)) {
+        return;
+    }
+    request->progress_len = received;
+
+    zval retval, *zreceived, *ztotal, *args[3];
+    MAKE_STD_ZVAL(zreceived);
+    ZVAL_LONG(zreceived, received);
+    MAKE_STD_ZVAL(ztotal);
+    content_length = evhttp_find_header(request->req->input_headers, "Content-Length");
+    if (content_length != NULL) {
+        ZVAL_LONG(ztotal, atol(content_length));
+    } else {
+        // chunked body, total is not known in advance
+        ZVAL_NULL(ztotal);
+    }
+
+    args[0] = zrequest;
+    args[1] = zreceived;
+    args[2] = ztotal;
+
+    if (call_user_function(EG(function_table), NULL, route->progress_handler, &retval, 3, args TSRMLS_CC) == SUCCESS) {
+        zval_dtor(&retval);
+    }
+    zval_ptr_dtor(&zreceived);
+    zval_ptr_dtor(&ztotal);
+
+    if (EG(exception)) {
+        request_exception(request TSRMLS_CC);
+    }
+}
 
-                if (buffer_len > content_len) {
-                    request->response_status = 400;
-                    spprintf(&request->error, 0, "Actual POST length %ld does not match Content-Length %ld", 
-                            buffer_len, content_len);
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+/**
+ * Connection of a request which did not reach request_handler was closed,
+ * e.g. libevent refused its body with 413 itself, so the request is logged here
+ */
+static void request_close_handler(struct evhttp_connection *evcon, void *arg)
+{
+    TSRMLS_FETCH();
+    struct evhttp_request *req = (struct evhttp_request *)arg;
+    struct php_can_server **server;
+    zval **zrequest;
+
+    if (FAILURE == zend_hash_index_find(&pending_requests, (ulong)req, (void **)&zrequest)) {
+        return;
+    }
+
+    if (SUCCESS == zend_hash_index_find(&servers, (ulong)evhttp_connection_get_server(evcon), (void **)&server)
+            && (*server)->logformat_len) {
+        struct php_can_server_request *request = (struct php_can_server_request *)
+            zend_object_store_get_object(*zrequest TSRMLS_CC);
+        struct php_can_server_logentry *logentry;
+
+        if (request_counter_used) {
+            request_counter++;
+        }
+        if (request->response_status == 0) {
+            request->response_status = evhttp_request_get_response_code(req);
+        }
+        if (request->error == NULL) {
+            spprintf(&request->error, 0, "Connection closed before the request was handled");
+        }
+        LOGENTRY_CTOR(logentry, request);
+        LOGENTRY_LOG(logentry, (*server), request_counter);
+        LOGENTRY_DTOR(logentry);
+    }
+
+    zend_hash_index_del(&pending_requests, (ulong)req);
+}
+
+/**
+ * Request body chunk arrived
+ */
+static void request_chunk_handler(struct evhttp_request *req, void *arg)
+{
+    TSRMLS_FETCH();
+    zval **zrequest;
+
+    if (SUCCESS == zend_hash_index_find(&pending_requests, (ulong)req, (void **)&zrequest)) {
+        struct php_can_server_request *request = (struct php_can_server_request *)
+            zend_object_store_get_object(*zrequest TSRMLS_CC);
+        struct evbuffer *buffer = evhttp_request_get_input_buffer(req);
+
+        if (request->multipart != NULL) {
+            // multipart body is parsed as it arrives, files go straight to disk
+            request->body_len += evbuffer_get_length(buffer);
+            if (request->response_status == 0
+                    && php_can_multipart_feed_buffer(request->multipart, buffer TSRMLS_CC) == FAILURE) {
+                request->response_status = php_can_multipart_status(request->multipart);
+                if (EG(exception)) {
+                    // storage handler has thrown
+                    request_exception(request TSRMLS_CC);
+                } else if (request->response_status == 413) {
+                    // limit the body to what was received, so that libevent replies 413
+                    // and closes the connection instead of reading the rest of the upload
+                    spprintf(&request->error, 0, "Uploaded file exceeds the size limit");
+                    evhttp_connection_set_max_body_size(evhttp_request_get_connection(req), request->body_len - 1);
+                } else if (request->response_status == 500) {
+                    spprintf(&request->error, 0, "Storage handler failed");
                 } else {
-                    content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
-                    if (content_type != NULL) {
-                        MAKE_STD_ZVAL(request->post);
-                        array_init(request->post);
-                        if (NULL != strstr(content_type, "multipart/form-data")) {
-                             php_can_parse_multipart(content_type, request->req->input_buffer, request->post, &request->files TSRMLS_CC);
-                        } else if (NULL != strstr(content_type, "application/x-www-form-urlencoded")) {
-                            php_default_treat_data(PARSE_STRING,
-                                estrndup(EVBUFFER_DATA( request->req->input_buffer ), buffer_len),
-                                request->post TSRMLS_CC
-                            );
-                        }
-                        // remove null bytes from post params
-                        zend_hash_apply(Z_ARRVAL_P(request->post), (apply_func_t) cleanUp TSRMLS_CC);
+                    spprintf(&request->error, 0, "Malformed multipart/form-data body");
+                }
+            }
+            evbuffer_drain(buffer, evbuffer_get_length(buffer));
+        } else {
+            request_body(*zrequest, buffer TSRMLS_CC);
+        }
+
+        request_progress(*zrequest, request->body_len, 0 TSRMLS_CC);
+    }
+}
+
+/**
+ * Start parsing multipart body while it is received, returns 0 if the body
+ * has to be buffered and parsed when the request is complete
+ */
+static int request_multipart(struct php_can_server_request *request TSRMLS_DC)
+{
+    const char *content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
+
+    if (content_type == NULL || NULL == strstr(content_type, "multipart/form-data")) {
+        return 0;
+    }
+
+    MAKE_STD_ZVAL(request->post);
+    array_init(request->post);
+    MAKE_STD_ZVAL(request->files);
+    array_init(request->files);
+
+    request->multipart = php_can_multipart_new(content_type, 
+        (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC),
+        request->post, request->files, &request->temp_files TSRMLS_CC);
+    if (request->multipart == NULL) {
+        // invalid boundary is reported the usual way once the body is read
+        zval_ptr_dtor(&request->post);
+        zval_ptr_dtor(&request->files);
+        return 0;
+    }
+    request->parsed |= PHP_CAN_SERVER_REQUEST_POST | PHP_CAN_SERVER_REQUEST_JSON;
+    return 1;
+}
+
+/**
+ * Request headers are read, body is not read yet
+ */
+static int request_header_handler(struct evhttp_request *req, void *arg)
+{
+    TSRMLS_FETCH();
+    struct php_can_server **server;
+    struct php_can_server_request *request;
+    struct php_can_server_route *route;
+    zval *zrequest;
+
+    if (FAILURE == zend_hash_index_find(&servers, (ulong)arg, (void **)&server)) {
+        return 0;
+    }
+
+    // create request object before the body arrives, so that we can route
+    // the request and hand body chunks over to the route's body handler
+    zrequest = request_new(req TSRMLS_CC);
+    request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+    route_request(*server, request TSRMLS_CC);
+
+    zend_hash_index_update(&pending_requests, (ulong)req, &zrequest, sizeof(zval *), NULL);
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), request_close_handler, req);
+
+    // body size limit is checked by libevent right after this callback returns: 
+    // oversized Content-Length is answered with 413 instead of 100 Continue
+    evhttp_connection_set_max_body_size(evhttp_request_get_connection(req), 
+        SG(post_max_size) > 0 ? SG(post_max_size) : -1);
+
+    if (request->route != NULL && request->response_status == 0) {
+        route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+        evhttp_connection_set_max_body_size(evhttp_request_get_connection(req), 
+            route->post_max_size > 0 ? route->post_max_size : -1);
+
+        if (route->body_handler != NULL 
+                || ((route->body_methods & request_method_flag(req->type)) && request_multipart(request TSRMLS_CC))) {
+            request->streaming = 1;
+            evhttp_request_set_chunked_cb(req, request_chunk_handler);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * New request arrived on the connection
+ */
+static int request_new_handler(struct evhttp_request *req, void *arg)
+{
+    evhttp_request_set_header_cb(req, request_header_handler);
+    return 0;
+}
+#endif
+
+static void cache_refresh_schedule(struct php_can_server *server, struct evhttp_request *req);
+
+/**
+ * Route the request and call its handler, refresh is a copy of the request
+ * whose response only replaces the stale one in the route cache
+ */
+static void request_dispatch(struct php_can_server *server, struct evhttp_request *req, 
+        zend_bool refresh TSRMLS_DC)
+{
+    if (request_counter_used && !refresh) { 
+        request_counter++;
+    }
+
+    zval *zrequest, **pending, *args[2];
+    struct php_can_server_request *request;
+    struct php_can_server_route *route = NULL;
+    const char *content_type = NULL, *content_length = NULL;
+    long content_len = 0, buffer_len = 0;
+    char *cache_key = NULL;
+    int cache_key_len = 0;
+    zend_bool stale = 0;
+    zval retval;
+    
+    struct evbuffer *buffer = evbuffer_new();
+    
+    if (SUCCESS == zend_hash_index_find(&pending_requests, (ulong)req, (void **)&pending)) {
+        // request object was already created and routed when headers arrived
+        zrequest = *pending;
+        Z_ADDREF_P(zrequest);
+        zend_hash_index_del(&pending_requests, (ulong)req);
+        evhttp_connection_set_closecb(evhttp_request_get_connection(req), NULL, NULL);
+        request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+    } else {
+        // create request object
+        zrequest = request_new(req TSRMLS_CC);
+        request = (struct php_can_server_request *)zend_object_store_get_object(zrequest TSRMLS_CC);
+        request->refresh = refresh;
+        route_request(server, request TSRMLS_CC);
+    }
+
+    if (request->route != NULL && request->response_status == 0) {
+
+        // set route
+        route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+
+        request_progress(zrequest, request->streaming ? request->body_len 
+            : (long)EVBUFFER_LENGTH(request->req->input_buffer), 1 TSRMLS_CC);
+
+#ifndef HAVE_EVHTTP_SET_NEWREQCB
+        // server accepts the largest body of all routes, limit of the route is checked here
+        if (route->post_max_size > 0 && (long)EVBUFFER_LENGTH(request->req->input_buffer) > route->post_max_size) {
+            request->response_status = 413;
+            spprintf(&request->error, 0, "Request body length %ld exceeds the limit of %ld bytes", 
+                    (long)EVBUFFER_LENGTH(request->req->input_buffer), route->post_max_size);
+        }
+#endif
+
+        if (route->body_handler != NULL && !request->streaming && request->response_status == 0) {
+            // body was buffered by libevent, so pass it at once to the body handler
+            request_body(zrequest, request->req->input_buffer TSRMLS_CC);
+        }
+            
+        if (request->multipart != NULL) {
+            // multipart body was parsed while it was received
+            php_can_multipart_feed_buffer(request->multipart, request->req->input_buffer TSRMLS_CC);
+            if (php_can_multipart_finish(request->multipart TSRMLS_CC) == FAILURE && request->response_status == 0) {
+                // body ended without the closing delimiter
+                request->response_status = php_can_multipart_status(request->multipart);
+                spprintf(&request->error, 0, "Malformed multipart/form-data body");
+            }
+            php_can_multipart_free(request->multipart TSRMLS_CC);
+            request->multipart = NULL;
+        } else if (!(route->body_methods & request_method_flag(request->req->type)) || route->body_handler != NULL) {
+            // there is no body to parse
+            request->parsed |= PHP_CAN_SERVER_REQUEST_POST | PHP_CAN_SERVER_REQUEST_JSON;
+        } else if (request->response_status == 0) {
+            // body parameters are parsed on first access, but malformed
+            // bodies are refused before the handler is called
+            buffer_len = EVBUFFER_LENGTH(request->req->input_buffer);
+            content_length = evhttp_find_header(request->req->input_headers, "Content-Length");
+            if (content_length != NULL) {
+                content_len = atol(content_length);
+            }
+
+            content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
+
+            if (buffer_len > content_len) {
+                request->response_status = 400;
+                spprintf(&request->error, 0, "Actual body length %ld does not match Content-Length %ld", 
+                        buffer_len, content_len);
+            } else if (content_type != NULL && route->json_max_size > 0 && buffer_len > route->json_max_size
+                    && (NULL != strstr(content_type, "application/json") || NULL != strstr(content_type, "+json"))) {
+                // JSON body is decoded on first access, oversized one is never decoded
+                request->response_status = 413;
+                spprintf(&request->error, 0, "JSON body length %ld exceeds the limit of %ld bytes", 
+                        buffer_len, route->json_max_size);
+            } else {
+                if (content_type != NULL && NULL != strstr(content_type, "multipart/form-data")) {
+                    const char *boundary = strstr(content_type, "boundary");
+                    if (boundary && (boundary = strchr(boundary, '=')) && boundary[1] == '"' 
+                            && NULL == strchr(boundary + 2, '"')) {
+                        php_can_throw_exception(
+                            ce_can_LogicException TSRMLS_CC,
+                            "Invalid boundary in multipart/form-data POST data"
+                        );
                     }
                 }
             }
+        }
+        
+        if (request->response_status == 0 && !EG(exception) && route->static_root != NULL) {
+
+            // static directory route, file is served without calling any handler
+            zval **file;
+            if (SUCCESS == zend_hash_find(Z_ARRVAL_P(request->params), route->static_param, 
+                    strlen(route->static_param) + 1, (void **)&file) && Z_TYPE_PP(file) == IS_STRING) {
+                // root was resolved by Route::staticDir(), so only the file path is resolved
+                php_can_send_file(request, Z_STRVAL_PP(file), Z_STRLEN_PP(file), route->static_root, 
+                    strlen(route->static_root), 1, NULL, 0, NULL, route->static_chunksize TSRMLS_CC);
+            } else {
+                request->response_status = 404;
+            }
+
+        } else if (request->response_status == 0 && !EG(exception) && route->cache_ttl > 0
+                && (cache_key = php_can_cache_key(route, request->req, &cache_key_len)) != NULL
+                && !refresh
+                && php_can_cache_send(route, request, cache_key, cache_key_len, &stale TSRMLS_CC) == SUCCESS) {
+
+            // response was served from the route cache, stale one is refreshed after the reply
+            if (stale) {
+                cache_refresh_schedule(server, req);
+            }
+            efree(cache_key);
+            cache_key = NULL;
+
+        } else if (request->response_status == 0 && !EG(exception)) {
             
-            if (request->response_status == 0) {
-                
-                // call handler
-                args[0] = zrequest;
-                args[1] = params;
-
-                Z_ADDREF_P(args[0]);
-                Z_ADDREF_P(args[1]);
-
-                if (call_user_function(EG(function_table), NULL, route->handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
-                    if (request->status != PHP_CAN_SERVER_RESPONSE_STATUS_SENT) {
-                        if (request->response_status == 0) {
-                            request->response_status = 200;
-                        }
-                        if (request->response_status >= 200 && request->response_status < 300) {
-                            if (Z_TYPE(retval) == IS_STRING) {
-                                if (Z_STRLEN(retval) > 0) {
-                                    request->response_len = Z_STRLEN(retval);
-                                    evbuffer_add(buffer, Z_STRVAL(retval), Z_STRLEN(retval));
-                                }
-                            } else if (Z_TYPE(retval) == IS_NULL) {
-                                // empty response
-                            } else {
-                                // non-scalar
+            // call handler
+            args[0] = zrequest;
+            args[1] = request->params;
+
+            Z_ADDREF_P(args[0]);
+            Z_ADDREF_P(args[1]);
+
+            if (call_user_function(EG(function_table), NULL, route->handler, &retval, 2, args TSRMLS_CC) == SUCCESS) {
+                if (request->status != PHP_CAN_SERVER_RESPONSE_STATUS_SENT) {
+                    if (request->response_status == 0) {
+                        request->response_status = 200;
+                    }
+                    if (request->response_status >= 200 && request->response_status < 300) {
+                        if (Z_TYPE(retval) == IS_STRING) {
+                            if (Z_STRLEN(retval) > 0) {
+                                request->response_len = Z_STRLEN(retval);
+                                evbuffer_add(buffer, Z_STRVAL(retval), Z_STRLEN(retval));
+                            }
+                        } else if (Z_TYPE(retval) == IS_NULL) {
+                            // empty response
+                        } else {
+                            // non-scalar
 #ifdef HAVE_JSON
-                                zend_class_entry **cep;
-                                if (Z_TYPE(retval) == IS_OBJECT 
-                                        && zend_lookup_class_ex("\\JsonSerializable", sizeof("\\JsonSerializable") - 1, NULL, 0, &cep TSRMLS_CC) == SUCCESS
-                                        && instanceof_function(Z_OBJCE(retval), *cep TSRMLS_CC)
-                                ) {
-                                    // implements JsonSerializable
-                                    zval *object = &retval, *result;
-                                    zend_call_method_with_0_params(&object, NULL, NULL, "jsonSerialize", &result);
-                                    if (result) {
-                                        if (Z_TYPE_P(result) == IS_STRING && Z_STRLEN_P(result) > 0) {
-                                            if (-1 != evhttp_add_header(request->req->output_headers, "Content-Type", 
-                                                    "application/json")) {
-                                                request->response_len = Z_STRLEN_P(result);
-                                                evbuffer_add(buffer, Z_STRVAL_P(result), Z_STRLEN_P(result));
-                                            }
+                            zend_class_entry **cep;
+                            if (Z_TYPE(retval) == IS_OBJECT 
+                                    && zend_lookup_class_ex("\\JsonSerializable", sizeof("\\JsonSerializable") - 1, NULL, 0, &cep TSRMLS_CC) == SUCCESS
+                                    && instanceof_function(Z_OBJCE(retval), *cep TSRMLS_CC)
+                            ) {
+                                // implements JsonSerializable
+                                zval *object = &retval, *result;
+                                zend_call_method_with_0_params(&object, NULL, NULL, "jsonSerialize", &result);
+                                if (result) {
+                                    if (Z_TYPE_P(result) == IS_STRING && Z_STRLEN_P(result) > 0) {
+                                        if (-1 != evhttp_add_header(request->req->output_headers, "Content-Type", 
+                                                "application/json")) {
+                                            request->response_len = Z_STRLEN_P(result);
+                                            evbuffer_add(buffer, Z_STRVAL_P(result), Z_STRLEN_P(result));
                                         }
-                                        zval_ptr_dtor(&result);
                                     }
-                                 
+                                    zval_ptr_dtor(&result);
                                 }
+                             
+                            }
 #endif
-                                if (request->response_len == 0) {
-                                    request->response_status = 500;
-                                    spprintf(&request->error, 0, "Request handler must return a string instead of %s", 
-                                        Z_TYPE(retval) == IS_ARRAY ? "array" : 
-                                            Z_TYPE(retval) == IS_OBJECT ? "object" :
-                                                Z_TYPE(retval) == IS_LONG ? "integer" :
-                                                    Z_TYPE(retval) == IS_DOUBLE ? "double" :
-                                                        Z_TYPE(retval) == IS_BOOL ? "boolean‚" :
-                                                            Z_TYPE(retval) == IS_RESOURCE ? "resource" : "unknown"
-                                    );
-                                }
+                            if (request->response_len == 0) {
+                                request->response_status = 500;
+                                spprintf(&request->error, 0, "Request handler must return a string instead of %s", 
+                                    Z_TYPE(retval) == IS_ARRAY ? "array" : 
+                                        Z_TYPE(retval) == IS_OBJECT ? "object" :
+                                            Z_TYPE(retval) == IS_LONG ? "integer" :
+                                                Z_TYPE(retval) == IS_DOUBLE ? "double" :
+                                                    Z_TYPE(retval) == IS_BOOL ? "boolean‚" :
+                                                        Z_TYPE(retval) == IS_RESOURCE ? "resource" : "unknown"
+                                );
                             }
                         }
                     }
-                    zval_dtor(&retval);
                 }
-                Z_DELREF_P(args[0]);
-                Z_DELREF_P(args[1]);
+                zval_dtor(&retval);
             }
+            Z_DELREF_P(args[0]);
+            Z_DELREF_P(args[1]);
         }
-        zval_ptr_dtor(&params);
     }
     
     if(EG(exception)) {
-        if (instanceof_function(Z_OBJCE_P(EG(exception)), ce_can_HTTPError TSRMLS_CC)) {
-            zval *code = NULL, *error = NULL;
-            code  = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "code", sizeof("code")-1, 1 TSRMLS_CC);
-            error = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "message", sizeof("message")-1, 1 TSRMLS_CC);
-            request->response_status = code ? Z_LVAL_P(code) : 500;
-            spprintf(&request->error, 0, "%s", error ? Z_STRVAL_P(error) : "Unknown");
-        } else {
-            zval *file = NULL, *line = NULL, *error = NULL;
-            file = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "file", sizeof("file")-1, 1 TSRMLS_CC);
-            line = zend_read_property(Z_OBJCE_P(EG(exception)), EG(exception), "line", sizeof("line")-1, 1 TSRMLS_CC);
-            request->response_status = 500;
-            spprintf(&request->error, 0, "Uncaught exception '%s' within request handler thrown in %s on line %d %s", 
-                    Z_OBJCE_P(EG(exception))->name,
-                    file ? Z_STRVAL_P(file) : NULL,
-                    line ? (int)Z_LVAL_P(line) : 0,
-                    error ? Z_STRVAL_P(error) : ""
-            );
+        request_exception(request TSRMLS_CC);
+    }
+
+    // ETag of the handler response is the hash of its body
+    int not_modified = 0, etag_added = 0, encoding = PHP_CAN_COMPRESS_NONE;
+    if (route != NULL && route->etag && request->status != PHP_CAN_SERVER_RESPONSE_STATUS_SENT
+            && request->response_status == 200 && EVBUFFER_LENGTH(buffer) > 0
+            && (request->req->type == EVHTTP_REQ_GET || request->req->type == EVHTTP_REQ_HEAD)
+            && evhttp_find_header(request->req->output_headers, "ETag") == NULL) {
+        char etag[sizeof("\"0123456789abcdef\"")];
+        snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)
+            php_can_xxh64(evbuffer_pullup(buffer, -1), EVBUFFER_LENGTH(buffer), 0));
+        evhttp_add_header(request->req->output_headers, "ETag", etag);
+        etag_added = 1;
+    }
+
+    if (request->status != PHP_CAN_SERVER_RESPONSE_STATUS_SENT) {
+        // compress before the ETag is compared, compressed body gets the tag of its own
+        encoding = php_can_compress_negotiate(request, EVBUFFER_LENGTH(buffer));
+        if (encoding != PHP_CAN_COMPRESS_NONE) {
+            php_can_compress_response(request, buffer, encoding TSRMLS_CC);
         }
-        zend_clear_exception(TSRMLS_C);
+    }
+
+    if (etag_added) {
+        const char *if_none_match = evhttp_find_header(request->req->input_headers, "If-None-Match");
+        not_modified = if_none_match != NULL && php_can_etag_matches(if_none_match, 
+            evhttp_find_header(request->req->output_headers, "ETag"));
+    }
+
+    if (cache_key != NULL) {
+        php_can_cache_store(route, request, cache_key, cache_key_len, buffer TSRMLS_CC);
+        efree(cache_key);
+    }
+
+    if (not_modified) {
+        // client has the same response, so send "Not Modified" without body
+        request->response_status = 304;
+        request->response_len = 0;
+        evbuffer_drain(buffer, EVBUFFER_LENGTH(buffer));
     }
     
+    if (refresh) {
+        // nobody waits for the refreshed response
+        evbuffer_free(buffer);
+        zval_ptr_dtor(&zrequest);
+        evhttp_request_free(req);
+        return;
+    }
+
     if (request->status != PHP_CAN_SERVER_RESPONSE_STATUS_SENT) {
         // send response
+        php_can_http_date_header(request->req);
         evhttp_send_reply(request->req, request->response_status, NULL, buffer);
     }
     
@@ -474,6 +841,65 @@ static void request_handler(struct evhttp_request *req, void *arg)
     LOGENTRY_DTOR(logentry);
 }
 
+static void request_handler(struct evhttp_request *req, void *arg)
+{
+    TSRMLS_FETCH();
+
+    request_dispatch((struct php_can_server *)arg, req, 0 TSRMLS_CC);
+}
+
+/**
+ * Copy of the request which refreshes the stale cached response
+ */
+struct php_can_cache_refresh {
+    struct evhttp *http;
+    struct evhttp_request *req;
+};
+
+static void cache_refresh_handler(evutil_socket_t fd, short events, void *arg)
+{
+    TSRMLS_FETCH();
+    struct php_can_cache_refresh *refresh = (struct php_can_cache_refresh *)arg;
+    struct php_can_server **server;
+
+    if (SUCCESS == zend_hash_index_find(&servers, (ulong)refresh->http, (void **)&server)) {
+        request_dispatch(*server, refresh->req, 1 TSRMLS_CC);
+    } else {
+        // server was stopped meanwhile
+        evhttp_request_free(refresh->req);
+    }
+    efree(refresh);
+}
+
+/**
+ * Call handler of the request once more when the loop gets back from the reply,
+ * the copy has no connection, so its response is never sent. If it cannot be
+ * scheduled the stale response is dropped when its stale period is over
+ */
+static void cache_refresh_schedule(struct php_can_server *server, struct evhttp_request *req)
+{
+    struct php_can_cache_refresh *refresh = emalloc(sizeof(*refresh));
+    struct evkeyval *header;
+    struct timeval tv = {0, 0};
+
+    refresh->http = server->http;
+    refresh->req = evhttp_request_new(NULL, NULL);
+    refresh->req->type = req->type;
+    refresh->req->major = req->major;
+    refresh->req->minor = req->minor;
+    refresh->req->uri = strdup(req->uri);
+    refresh->req->uri_elems = evhttp_uri_parse(req->uri);
+    TAILQ_FOREACH(header, req->input_headers, next) {
+        evhttp_add_header(refresh->req->input_headers, header->key, header->value);
+    }
+
+    if (refresh->req->uri_elems == NULL 
+            || event_once(-1, EV_TIMEOUT, cache_refresh_handler, refresh, &tv) != 0) {
+        evhttp_request_free(refresh->req);
+        efree(refresh);
+    }
+}
+
 /**
  * Constructor
  *
@@ -534,6 +960,12 @@ static PHP_METHOD(CanServer, __construct)
     // set timeout to a reasonably short value for performance
     evhttp_set_timeout(server->http, 10);
 
+    // bodies over post_max_size are refused with 413 by libevent, routes
+    // override the limit per request when the header callback is available
+    if (SG(post_max_size) > 0) {
+        evhttp_set_max_body_size(server->http, SG(post_max_size));
+    }
+
     server->addr = estrndup(addr, addr_len);
     server->port = port;
     server->running = 0;
@@ -569,6 +1001,42 @@ static PHP_METHOD(CanServer, __construct)
     }
 }
 
+#ifndef HAVE_EVHTTP_SET_NEWREQCB
+/**
+ * Body size limit cannot be set per request without the header callback, so
+ * the server keeps the post_max_size ini setting, only routes with the large_body
+ * option raise it. Such bodies are buffered before the route limit is checked
+ */
+static void server_max_body_size(struct php_can_server *server, zval *zrouter TSRMLS_DC)
+{
+    struct php_can_server_router *router = (struct php_can_server_router *)
+        zend_object_store_get_object(zrouter TSRMLS_CC);
+    struct php_can_server_route *route;
+    zval **zroute;
+    long max = SG(post_max_size) > 0 ? SG(post_max_size) : -1;
+
+    if (max == -1 || router->routes == NULL || zend_hash_num_elements(Z_ARRVAL_P(router->routes)) == 0) {
+        return;
+    }
+
+    PHP_CAN_FOREACH(router->routes, zroute) {
+        route = (struct php_can_server_route *)zend_object_store_get_object(*zroute TSRMLS_CC);
+        if (!route->large_body) {
+            continue;
+        }
+        if (route->post_max_size <= 0) {
+            // route without limit
+            max = -1;
+            break;
+        }
+        if (route->post_max_size > max) {
+            max = route->post_max_size;
+        }
+    }
+    evhttp_set_max_body_size(server->http, max);
+}
+#endif
+
 /**
  * Start server
  *
@@ -596,9 +1064,17 @@ static PHP_METHOD(CanServer, start)
     server->router = zrouter;
     server->running = 1;
 
+    zend_hash_index_update(&servers, (ulong)server->http, &server, sizeof(struct php_can_server *), NULL);
     evhttp_set_gencb(server->http, request_handler, (void*)server);
+#ifdef HAVE_EVHTTP_SET_NEWREQCB
+    evhttp_set_newreqcb(server->http, request_new_handler, (void*)server);
+#else
+    server_max_body_size(server, zrouter TSRMLS_CC);
+#endif
 
     event_dispatch();
+
+    zend_hash_index_del(&servers, (ulong)server->http);
 }
 
 /**
@@ -634,10 +1110,151 @@ static PHP_METHOD(CanServer, stop)
     }
 }
 
+/**
+ * Configure cache of the files served by Request::sendFile(), size is
+ * the max number of the open files kept, 0 disables the cache, ttl is
+ * the number of seconds after which cached file is checked for changes
+ *
+ */
+static PHP_METHOD(CanServer, setFileCache)
+{
+    long size, ttl = PHP_CAN_SERVER_FILE_CACHE_TTL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l|l", &size, &ttl) || size < 0 || ttl < 0) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $size[, int $ttl = %d])",
+            class_name, space, get_active_function_name(TSRMLS_C),
+            PHP_CAN_SERVER_FILE_CACHE_TTL
+        );
+        return;
+    }
+
+    php_can_file_cache_configure(size, ttl TSRMLS_CC);
+}
+
+/**
+ * Configure memory cache of the files served by Request::sendFile(), size is
+ * the memory budget in bytes, 0 disables the cache, files larger than
+ * max_file_size are always sent from disk
+ *
+ */
+static PHP_METHOD(CanServer, setMemoryCache)
+{
+    long size, max_file_size = PHP_CAN_SERVER_MEMORY_CACHE_MAX_FILE;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "l|l", &size, &max_file_size) || size < 0 || max_file_size < 0) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(int $size[, int $max_file_size = %d])",
+            class_name, space, get_active_function_name(TSRMLS_C),
+            PHP_CAN_SERVER_MEMORY_CACHE_MAX_FILE
+        );
+        return;
+    }
+
+    php_can_file_memory_configure(size, max_file_size TSRMLS_CC);
+}
+
+/**
+ * Load mime types used by Request::sendFile() from the file
+ * in mime.types format, returns number of loaded extensions
+ *
+ */
+static PHP_METHOD(CanServer, loadMimeTypes)
+{
+    char *filename;
+    int filename_len;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "p", &filename, &filename_len) || filename_len == 0) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $filename)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    int count = php_can_mimetypes_load(filename TSRMLS_CC);
+    if (count == FAILURE) {
+        php_can_throw_exception(
+            ce_can_RuntimeException TSRMLS_CC,
+            "Cannot read mime types from the file '%s'", filename
+        );
+        return;
+    }
+
+    RETURN_LONG(count);
+}
+
+/**
+ * Configure compression of the handler responses negotiated by Accept-Encoding,
+ * level of 0 disables it, responses shorter than min_size are sent as is,
+ * types replace the list of compressed mime types
+ *
+ */
+static PHP_METHOD(CanServer, setCompression)
+{
+    long level = PHP_CAN_SERVER_COMPRESSION_LEVEL, min_size = PHP_CAN_SERVER_COMPRESSION_MIN_SIZE;
+    zval *types = NULL;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "|lla", &level, &min_size, &types) || level < 0 || level > 9 || min_size < 0) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s([int $level = %d[, int $min_size = %d[, array $types]]])",
+            class_name, space, get_active_function_name(TSRMLS_C),
+            PHP_CAN_SERVER_COMPRESSION_LEVEL, PHP_CAN_SERVER_COMPRESSION_MIN_SIZE
+        );
+        return;
+    }
+
+    if (FAILURE == php_can_compress_configure(level, min_size, types TSRMLS_CC)) {
+        php_can_throw_exception(
+            ce_can_RuntimeException TSRMLS_CC,
+            "Compression is not available, extension was built without zlib"
+        );
+        return;
+    }
+}
+
+/**
+ * Get totals of the compressed responses: level, responses, bytes_in,
+ * bytes_out and cpu_time spent compressing in seconds
+ *
+ */
+static PHP_METHOD(CanServer, getCompressionStats)
+{
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC, "")) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(void)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    array_init(return_value);
+    php_can_compress_stats(return_value TSRMLS_CC);
+}
+
 static zend_function_entry server_methods[] = {
     PHP_ME(CanServer, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServer, start,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServer, stop,        NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setFileCache, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setMemoryCache, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, loadMimeTypes, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, setCompression, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServer, getCompressionStats, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -668,10 +1285,20 @@ PHP_MSHUTDOWN_FUNCTION(can_server)
 
 PHP_RINIT_FUNCTION(can_server)
 {
+    zend_hash_init(&servers, 1, NULL, NULL, 0);
+    zend_hash_init(&pending_requests, 16, NULL, ZVAL_PTR_DTOR, 0);
+    php_can_file_cache_init(TSRMLS_C);
+    php_can_mimetypes_init(TSRMLS_C);
+    php_can_compress_init(TSRMLS_C);
     return SUCCESS;
 }
 
 PHP_RSHUTDOWN_FUNCTION(can_server)
 {
+    php_can_compress_destroy(TSRMLS_C);
+    php_can_mimetypes_destroy(TSRMLS_C);
+    php_can_file_cache_destroy(TSRMLS_C);
+    zend_hash_destroy(&pending_requests);
+    zend_hash_destroy(&servers);
     return SUCCESS;
 }
@@ -19,7 +19,15 @@
 #ifndef CAN_HTTPSVC_SERVER_H
 #define CAN_HTTPSVC_SERVER_H
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/stat.h>
+#include <stdint.h>
+
 #include "php.h"
+#include "SAPI.h"
 #include "fopen_wrappers.h"
 #include "ext/date/php_date.h"
 #include "ext/standard/php_array.h"
@@ -42,6 +50,42 @@
 #define PHP_CAN_SERVER_RESPONSE_STATUS_SENDING 1
 #define PHP_CAN_SERVER_RESPONSE_STATUS_SENT    2
 
+#define PHP_CAN_SERVER_REQUEST_COOKIES  1
+#define PHP_CAN_SERVER_REQUEST_GET      2
+#define PHP_CAN_SERVER_REQUEST_POST     4
+#define PHP_CAN_SERVER_REQUEST_JSON     8
+
+#define PHP_CAN_SERVER_JSON_MAX_DEPTH   512
+
+#define PHP_CAN_SERVER_PROGRESS_INTERVAL 65536
+
+#define PHP_CAN_SERVER_FIELD_MAX_SIZE   1048576
+
+#define PHP_CAN_SERVER_FILE_CACHE_SIZE  256
+#define PHP_CAN_SERVER_FILE_CACHE_TTL   2
+
+#define PHP_CAN_SERVER_MEMORY_CACHE_MAX_FILE 65536
+
+#define PHP_CAN_FILE_ENCODING_BR        0
+#define PHP_CAN_FILE_ENCODING_GZIP      1
+#define PHP_CAN_FILE_ENCODINGS          2
+
+#define PHP_CAN_HTTP_DATE_LEN           29
+
+#define PHP_CAN_SERVER_MAX_RANGES       16
+
+#define PHP_CAN_SERVER_STATIC_CHUNKSIZE 8192
+
+#define PHP_CAN_SERVER_CACHE_MAX_SIZE   1048576
+
+#define PHP_CAN_SERVER_COMPRESSION_LEVEL    6
+#define PHP_CAN_SERVER_COMPRESSION_MIN_SIZE 1024
+
+#define PHP_CAN_COMPRESS_NONE           -1
+#define PHP_CAN_COMPRESS_GZIP           0
+#define PHP_CAN_COMPRESS_DEFLATE        1
+#define PHP_CAN_COMPRESS_ENCODINGS      2
+
 #define PHP_CAN_SERVER_ROUTE_METHOD_GET        1
 #define PHP_CAN_SERVER_ROUTE_METHOD_POST       2
 #define PHP_CAN_SERVER_ROUTE_METHOD_HEAD       4
@@ -76,16 +120,31 @@ struct php_can_server {
     zval *router;
 };
 
+struct php_can_multipart;
+
 struct php_can_server_request {
     zend_object std;
     zval refhandle;
     struct evhttp_request *req;
+    zval *route;
+    zval *params;
+    zval *headers;
     zval *cookies;
     zval *get;
     zval *post;
     zval *files;
+    HashTable *temp_files;
+    zval *json;
+    struct php_can_multipart *multipart;
+    int parsed;
+    zend_bool snapshot;
+    int snapshot_status;
     double time;
     int status;
+    zend_bool streaming;
+    zend_bool refresh;
+    long body_len;
+    long progress_len;
     long response_len;
     long response_status;
     char *error;
@@ -99,8 +158,42 @@ struct php_can_server_route {
     char *route;
     char *regexp;
     zval *handler;
+    zval *body_handler;
+    zval *progress_handler;
+    zval *storage_handler;
+    long progress_interval;
+    int  body_methods;
+    long json_max_size;
+    long json_max_depth;
+    long upload_memory_limit;
+    long upload_max_filesize;
+    long field_max_size;
+    long post_max_size;
+    /**
+     * Route may accept bodies over the post_max_size ini setting, without
+     * the header callback of libevent this raises the limit of the server
+     */
+    zend_bool large_body;
     int  methods;
     zval *casts;
+    /**
+     * Resolved root of the Route::staticDir() route, its files
+     * are served without calling request handler
+     */
+    char *static_root;
+    char *static_param;
+    long static_chunksize;
+    /**
+     * Responses of the route cached for cache_ttl seconds and served stale
+     * for cache_stale seconds more while they are refreshed after the reply
+     */
+    long cache_ttl;
+    long cache_stale;
+    long cache_max_size;
+    long cache_len;
+    zval *cache_vary;
+    HashTable *cache;
+    zend_bool etag;
 };
 
 struct php_can_server_router {
@@ -133,6 +226,36 @@ struct php_can_server_router {
     zval *route_methods;
 };
 
+struct php_can_file {
+    char *path;
+    int fd;
+    struct stat st;
+    char etag[64];
+    char last_modified[PHP_CAN_HTTP_DATE_LEN + 1];
+    char *mimetype;
+    time_t checked;
+    zend_bool cached;
+    /**
+     * Precompressed siblings of the file by encoding, looked up once
+     * per revalidation, checked is a bitmask of the encodings looked up
+     */
+    struct php_can_file *variants[PHP_CAN_FILE_ENCODINGS];
+    int variants_checked;
+    /**
+     * Content of the file kept in memory and its place in the list
+     * of the contents ordered by the last use
+     */
+    struct evbuffer *content;
+    struct php_can_file *lru_prev;
+    struct php_can_file *lru_next;
+    zend_bool watched;
+};
+
+struct php_can_range {
+    long from;
+    long len;
+};
+
 struct php_can_server_logentry {
     double request_time;
     int    request_type;
@@ -200,12 +323,10 @@ struct php_can_server_logentry {
         add_assoc_long(map, "x-reqnum", count); \
     if (php_can_strpos(server->logformat, "x-memusage", 0) != FAILURE) \
         add_assoc_long(map, "x-memusage", zend_memory_usage(0 TSRMLS_CC)); \
-    if (php_can_strpos(server->logformat, "time", 0) != FAILURE) { \
-        char *str_time = php_format_date("H:i:s", sizeof("H:i:s"), (long)now, 1 TSRMLS_CC); \
-        add_assoc_string(map, "time", str_time, 0); } \
-    if (php_can_strpos(server->logformat, "date", 0) != FAILURE) { \
-        char *str_time = php_format_date("Y-m-d", sizeof("Y-m-d"), (long)now, 1 TSRMLS_CC); \
-        add_assoc_string(map, "date", str_time, 0); } \
+    if (php_can_strpos(server->logformat, "time", 0) != FAILURE) \
+        add_assoc_string(map, "time", (char *)php_can_log_time((time_t)now TSRMLS_CC), 1); \
+    if (php_can_strpos(server->logformat, "date", 0) != FAILURE) \
+        add_assoc_string(map, "date", (char *)php_can_log_date((time_t)now TSRMLS_CC), 1); \
     if (php_can_strpos(server->logformat, "time-taken", 0) != FAILURE) \
         add_assoc_long(map, "time-taken", (now - logentry->request_time) * 1000); \
     if (php_can_strpos(server->logformat, "bytes", 0) != FAILURE) { \
@@ -225,6 +346,63 @@ struct php_can_server_logentry {
     efree(logentry->error); \
     efree(logentry); 
 
+size_t php_can_url_decode(char *dst, const char *src, size_t len);
+void php_can_parse_urlencoded(const char *str, size_t len, zval *array TSRMLS_DC);
+void php_can_parse_cookies(const char *str, size_t len, zval *array TSRMLS_DC);
+int php_can_find_cookie(const char *str, size_t len, const char *cookie, size_t cookie_len, zval *retval TSRMLS_DC);
+int php_can_json_depth_exceeds(const char *str, size_t len, long depth);
+int php_can_etag_matches(const char *header, const char *etag);
+int php_can_accepts_encoding(const char *header, const char *coding);
+uint64_t php_can_xxh64(const void *data, size_t len, uint64_t seed);
+struct php_can_multipart *php_can_multipart_new(const char *content_type, struct php_can_server_route *route, 
+        zval *post, zval *files, HashTable **temp_files TSRMLS_DC);
+int php_can_multipart_feed(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC);
+int php_can_multipart_feed_buffer(struct php_can_multipart *mp, struct evbuffer *buffer TSRMLS_DC);
+int php_can_multipart_finish(struct php_can_multipart *mp TSRMLS_DC);
+long php_can_multipart_status(struct php_can_multipart *mp);
+void php_can_multipart_free(struct php_can_multipart *mp TSRMLS_DC);
+long php_can_parse_multipart(const char* content_type, struct php_can_server_route *route, 
+        struct evbuffer* buffer, zval* post, zval** files, HashTable **temp_files TSRMLS_DC);
+void php_can_multipart_temp_files_free(HashTable **temp_files);
+struct php_can_file *php_can_file_open(char *root, int root_len, zend_bool root_resolved, 
+        char *filename, int filename_len TSRMLS_DC);
+void php_can_file_release(struct php_can_file *file);
+struct php_can_file *php_can_file_variant(struct php_can_file *file, int encoding TSRMLS_DC);
+struct evbuffer *php_can_file_content(struct php_can_file *file TSRMLS_DC);
+void php_can_file_memory_configure(long size, long max_file TSRMLS_DC);
+void php_can_file_cache_configure(long size, long ttl TSRMLS_DC);
+void php_can_file_cache_init(TSRMLS_D);
+void php_can_file_cache_destroy(TSRMLS_D);
+const char *php_can_mimetype(const char *path, size_t len);
+int php_can_mimetypes_load(const char *filename TSRMLS_DC);
+void php_can_mimetypes_init(TSRMLS_D);
+void php_can_mimetypes_destroy(TSRMLS_D);
+size_t php_can_http_date(time_t t, char *buf);
+time_t php_can_http_date_parse(const char *str);
+const char *php_can_http_now(void);
+void php_can_http_date_header(struct evhttp_request *req);
+const char *php_can_log_date(time_t now TSRMLS_DC);
+const char *php_can_log_time(time_t now TSRMLS_DC);
+
+char *php_can_cache_key(struct php_can_server_route *route, struct evhttp_request *req, int *key_len);
+int php_can_cache_send(struct php_can_server_route *route, struct php_can_server_request *request,
+        const char *key, int key_len, zend_bool *stale TSRMLS_DC);
+void php_can_cache_store(struct php_can_server_route *route, struct php_can_server_request *request,
+        const char *key, int key_len, struct evbuffer *body TSRMLS_DC);
+void php_can_cache_free(struct php_can_server_route *route);
+int php_can_compress_configure(long level, long min_size, zval *types TSRMLS_DC);
+int php_can_compress_accepted(struct evhttp_request *req);
+const char *php_can_compress_encoding_name(int encoding);
+int php_can_compress_negotiate(struct php_can_server_request *request, size_t len);
+int php_can_compress_response(struct php_can_server_request *request, struct evbuffer *buffer,
+        int encoding TSRMLS_DC);
+void php_can_compress_stats(zval *array TSRMLS_DC);
+void php_can_compress_init(TSRMLS_D);
+void php_can_compress_destroy(TSRMLS_D);
+void php_can_send_file(struct php_can_server_request *request, char *filename, int filename_len, 
+        char *root, int root_len, zend_bool root_resolved, char *mimetype, int mimetype_len, 
+        zval *download, long chunksize TSRMLS_DC);
+
 PHP_MINIT_FUNCTION(can_server);
 PHP_MSHUTDOWN_FUNCTION(can_server);
 PHP_RINIT_FUNCTION(can_server);
@@ -26,6 +26,8 @@
 #include <evhttp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 zend_class_entry *ce_can_server_request;
 static zend_object_handlers server_request_obj_handlers;
@@ -39,11 +41,24 @@ static zend_object_value server_request_ctor(zend_class_entry *ce TSRMLS_DC)
 
     request = ecalloc(1, sizeof(*request));
     zend_object_std_init(&request->std, ce TSRMLS_CC);
+    request->route = NULL;
+    request->params = NULL;
+    request->headers = NULL;
     request->cookies = NULL;
     request->get = NULL;
     request->post = NULL;
     request->files = NULL;
+    request->temp_files = NULL;
+    request->json = NULL;
+    request->multipart = NULL;
+    request->parsed = 0;
+    request->snapshot = 0;
+    request->snapshot_status = 0;
     request->status = PHP_CAN_SERVER_RESPONSE_STATUS_NONE;
+    request->streaming = 0;
+    request->refresh = 0;
+    request->body_len = 0;
+    request->progress_len = 0;
     request->uri = NULL;
     request->query = NULL;
     request->response_status = 0;
@@ -65,6 +80,18 @@ static void server_request_dtor(void *object TSRMLS_DC)
         request->req = NULL;
     }
 
+    if (request->route) {
+        zval_ptr_dtor(&request->route);
+    }
+
+    if (request->params) {
+        zval_ptr_dtor(&request->params);
+    }
+
+    if (request->headers) {
+        zval_ptr_dtor(&request->headers);
+    }
+
     if (request->cookies) {
         zval_ptr_dtor(&request->cookies);
     }
@@ -81,6 +108,18 @@ static void server_request_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&request->files);
     }
 
+    php_can_multipart_temp_files_free(&request->temp_files);
+
+    if (request->json) {
+        zval_ptr_dtor(&request->json);
+    }
+
+    if (request->multipart) {
+        // upload was interrupted, temporary file of the unfinished part is removed
+        php_can_multipart_free(request->multipart TSRMLS_CC);
+        request->multipart = NULL;
+    }
+
     if (request->uri) {
         efree(request->uri);
         request->uri = NULL;
@@ -101,13 +140,177 @@ static void server_request_dtor(void *object TSRMLS_DC)
     efree(request);
 }
 
+/**
+ * Parse request collections on first access
+ */
+static void request_parse(struct php_can_server_request *request, int what TSRMLS_DC)
+{
+    what &= ~request->parsed;
+    if (what == 0) {
+        return;
+    }
+    request->parsed |= what;
+
+    if (what & PHP_CAN_SERVER_REQUEST_COOKIES) {
+        const char *cookie = evhttp_find_header(request->req->input_headers, "Cookie");
+        if (cookie != NULL) {
+            MAKE_STD_ZVAL(request->cookies);
+            array_init(request->cookies);
+            php_can_parse_cookies(cookie, strlen(cookie), request->cookies TSRMLS_CC);
+        }
+    }
+
+    if (what & PHP_CAN_SERVER_REQUEST_GET) {
+        if (request->query != NULL) {
+            MAKE_STD_ZVAL(request->get);
+            array_init(request->get);
+            php_can_parse_urlencoded(request->query, strlen(request->query), request->get TSRMLS_CC);
+        }
+    }
+
+    if (what & PHP_CAN_SERVER_REQUEST_POST) {
+        const char *content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
+        if (content_type != NULL) {
+            MAKE_STD_ZVAL(request->post);
+            array_init(request->post);
+            if (NULL != strstr(content_type, "multipart/form-data")) {
+                long status = php_can_parse_multipart(content_type, 
+                    request->route ? (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC) : NULL,
+                    request->req->input_buffer, request->post, &request->files, &request->temp_files TSRMLS_CC);
+                if (status == 413) {
+                    php_can_throw_exception_code(
+                        ce_can_HTTPError TSRMLS_CC, 413,
+                        "Uploaded file exceeds the size limit"
+                    );
+                }
+            } else if (NULL != strstr(content_type, "application/x-www-form-urlencoded")) {
+                php_can_parse_urlencoded(
+                    (const char *)EVBUFFER_DATA( request->req->input_buffer ), 
+                    EVBUFFER_LENGTH( request->req->input_buffer ),
+                    request->post TSRMLS_CC
+                );
+            }
+        }
+    }
+}
+
+/**
+ * Check whether request body is declared as JSON
+ */
+static int request_is_json(struct php_can_server_request *request)
+{
+    const char *content_type = evhttp_find_header(request->req->input_headers, "Content-Type");
+    return content_type != NULL 
+        && (NULL != strstr(content_type, "application/json") || NULL != strstr(content_type, "+json"));
+}
+
+#ifdef HAVE_JSON
+/**
+ * Decode JSON body on first access, body is decoded in place from the input 
+ * buffer when there is room to terminate it, otherwise it is copied once
+ */
+static int request_parse_json(struct php_can_server_request *request TSRMLS_DC)
+{
+    struct php_can_server_route *route;
+    struct evbuffer *buffer = request->req->input_buffer;
+    struct evbuffer_iovec vec;
+    size_t len = evbuffer_get_length(buffer);
+    long depth = PHP_CAN_SERVER_JSON_MAX_DEPTH;
+    char *data, *str;
+
+    if (request->parsed & PHP_CAN_SERVER_REQUEST_JSON) {
+        return SUCCESS;
+    }
+
+    if (len == 0 || !request_is_json(request)) {
+        request->parsed |= PHP_CAN_SERVER_REQUEST_JSON;
+        return SUCCESS;
+    }
+
+    if (request->route != NULL) {
+        route = (struct php_can_server_route *)zend_object_store_get_object(request->route TSRMLS_CC);
+        depth = route->json_max_depth;
+    }
+
+    str = data = (char *)evbuffer_pullup(buffer, -1);
+    if (php_can_json_depth_exceeds(data, len, depth)) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 400,
+            "JSON request body exceeds maximum nesting depth of %ld", depth
+        );
+        return FAILURE;
+    }
+
+    // decoder expects zero terminated string, reserved space is not committed
+    // so the terminator never becomes part of the body
+    if (evbuffer_reserve_space(buffer, 1, &vec, 1) == 1 
+            && (data = (char *)evbuffer_pullup(buffer, -1)) + len == (char *)vec.iov_base) {
+        str = data;
+        str[len] = '\0';
+    } else {
+        str = estrndup(data, len);
+    }
+
+    MAKE_STD_ZVAL(request->json);
+    php_json_decode_ex(request->json, str, len, PHP_JSON_OBJECT_AS_ARRAY, depth TSRMLS_CC);
+
+    if (str != data) {
+        efree(str);
+    }
+
+    if (JSON_G(error_code) != PHP_JSON_ERROR_NONE) {
+        zval_ptr_dtor(&request->json);
+        request->json = NULL;
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 400,
+            "Malformed JSON request body"
+        );
+        return FAILURE;
+    }
+    // malformed body is never marked as parsed, so every read raises the error
+    request->parsed |= PHP_CAN_SERVER_REQUEST_JSON;
+    return SUCCESS;
+}
+#endif
+
+/**
+ * Get request collection, empty collection is created on demand
+ */
+static zval *request_collection(zval **collection)
+{
+    if (*collection == NULL) {
+        MAKE_STD_ZVAL(*collection);
+        array_init(*collection);
+    }
+    return *collection;
+}
+
+/**
+ * Get request headers, headers are materialized once per request
+ */
+static zval *request_headers(struct php_can_server_request *request)
+{
+    struct evkeyval *header;
+
+    if (request->headers == NULL) {
+        MAKE_STD_ZVAL(request->headers);
+        array_init(request->headers);
+        for (header = ((request->req->input_headers)->tqh_first);
+             header; 
+             header = ((header)->next.tqe_next)
+        ) {
+            add_assoc_string(request->headers, header->key, header->value, 1);
+        }
+    }
+    return request->headers;
+}
+
 static zval *read_property(zval *object, zval *member, int type, const zend_literal *key TSRMLS_DC)
 {
     struct php_can_server_request *request;
     zval tmp_member;
     zval *retval;
     zend_object_handlers *std_hnd;
-    struct evkeyval *header;
     char * str;
 
     request = (struct php_can_server_request*)zend_object_store_get_object(object TSRMLS_CC);
@@ -170,71 +373,50 @@ static zval *read_property(zval *object, zval *member, int type, const zend_lite
     } else if (Z_STRLEN_P(member) == (sizeof("headers") - 1)
             && !memcmp(Z_STRVAL_P(member), "headers", Z_STRLEN_P(member))) {
 
-        MAKE_STD_ZVAL(retval);
-        array_init(retval);
-        for (header = ((request->req->input_headers)->tqh_first);
-             header; 
-             header = ((header)->next.tqe_next)
-        ) {
-            add_assoc_string(retval, header->key, header->value, 1);
-        }
-        Z_SET_REFCOUNT_P(retval, 0);
+        retval = request_headers(request);
 
     } else if (Z_STRLEN_P(member) == (sizeof("cookies") - 1)
             && !memcmp(Z_STRVAL_P(member), "cookies", Z_STRLEN_P(member))) {
 
-        MAKE_STD_ZVAL(retval);
-        array_init(retval);
-        if (request->cookies) {
-            zval *tmp;
-            zend_hash_copy(
-                Z_ARRVAL_P(retval), Z_ARRVAL_P(request->cookies),
-                (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-            );
-        }
-        Z_SET_REFCOUNT_P(retval, 0);
+        // stored collection is returned, engine separates it on write
+        request_parse(request, PHP_CAN_SERVER_REQUEST_COOKIES TSRMLS_CC);
+        retval = request_collection(&request->cookies);
 
     } else if (Z_STRLEN_P(member) == (sizeof("get") - 1)
             && !memcmp(Z_STRVAL_P(member), "get", Z_STRLEN_P(member))) {
 
-        MAKE_STD_ZVAL(retval);
-        array_init(retval);
-        if (request->get) {
-            zval *tmp;
-            zend_hash_copy(
-                Z_ARRVAL_P(retval), Z_ARRVAL_P(request->get),
-                (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-            );
-        }
-        Z_SET_REFCOUNT_P(retval, 0);
+        // stored collection is returned, engine separates it on write
+        request_parse(request, PHP_CAN_SERVER_REQUEST_GET TSRMLS_CC);
+        retval = request_collection(&request->get);
 
     } else if (Z_STRLEN_P(member) == (sizeof("post") - 1)
             && !memcmp(Z_STRVAL_P(member), "post", Z_STRLEN_P(member))) {
 
-        MAKE_STD_ZVAL(retval);
-        array_init(retval);
-        if (request->post) {
-            zval *tmp;
-            zend_hash_copy(
-                Z_ARRVAL_P(retval), Z_ARRVAL_P(request->post),
-                (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-            );
-        }
-        Z_SET_REFCOUNT_P(retval, 0);
+        // stored collection is returned, engine separates it on write
+        request_parse(request, PHP_CAN_SERVER_REQUEST_POST TSRMLS_CC);
+        retval = request_collection(&request->post);
 
     } else if (Z_STRLEN_P(member) == (sizeof("files") - 1)
             && !memcmp(Z_STRVAL_P(member), "files", Z_STRLEN_P(member))) {
 
-        MAKE_STD_ZVAL(retval);
-        array_init(retval);
-        if (request->files) {
-            zval *tmp;
-            zend_hash_copy(
-                Z_ARRVAL_P(retval), Z_ARRVAL_P(request->files),
-                (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-            );
+        // stored collection is returned, engine separates it on write
+        request_parse(request, PHP_CAN_SERVER_REQUEST_POST TSRMLS_CC);
+        retval = request_collection(&request->files);
+
+    } else if (Z_STRLEN_P(member) == (sizeof("json") - 1)
+            && !memcmp(Z_STRVAL_P(member), "json", Z_STRLEN_P(member))) {
+
+#ifdef HAVE_JSON
+        // decoded body is stored, malformed body raises HTTPError 400
+        if (request_parse_json(request TSRMLS_CC) == SUCCESS && request->json != NULL) {
+            retval = request->json;
+        } else
+#endif
+        {
+            MAKE_STD_ZVAL(retval);
+            ZVAL_NULL(retval);
+            Z_SET_REFCOUNT_P(retval, 0);
         }
-        Z_SET_REFCOUNT_P(retval, 0);
 
     } else if (Z_STRLEN_P(member) == (sizeof("status") - 1)
             && !memcmp(Z_STRVAL_P(member), "status", Z_STRLEN_P(member))) {
@@ -268,101 +450,98 @@ static HashTable *get_properties(zval *object TSRMLS_DC) /* {{{ */
     HashTable *props;
     zval *zv;
     char *str;
-    struct evkeyval *header;
     
     struct php_can_server_request *request = (struct php_can_server_request*)
         zend_objects_get_address(object TSRMLS_CC);
     
     
     props = zend_std_get_properties(object TSRMLS_CC);
+
+    if (request->snapshot) {
+        // snapshot was already taken, only response status may change
+        if (request->snapshot_status != request->status) {
+            request->snapshot_status = request->status;
+            MAKE_STD_ZVAL(zv);
+            ZVAL_LONG(zv, (int)request->status);
+            zend_hash_update(props, "status", sizeof("status"), &zv, sizeof(zval *), NULL);
+        }
+        return props;
+    }
+    request->snapshot = 1;
+    request->snapshot_status = request->status;
+
+    request_parse(request, PHP_CAN_SERVER_REQUEST_COOKIES
+        | PHP_CAN_SERVER_REQUEST_GET | PHP_CAN_SERVER_REQUEST_POST TSRMLS_CC);
     
     MAKE_STD_ZVAL(zv);
     ZVAL_STRING(zv, php_can_method_name(request->req->type), 1);
-    zend_hash_update(props, "method", sizeof("method"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "method", sizeof("method"), &zv, sizeof(zval *), NULL);
     
     MAKE_STD_ZVAL(zv);
     ZVAL_STRING(zv, request->uri != NULL ? request->uri : "", 1);
-    zend_hash_update(props, "uri", sizeof("uri"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "uri", sizeof("uri"), &zv, sizeof(zval *), NULL);
     
     MAKE_STD_ZVAL(zv);
     ZVAL_STRING(zv, request->query != NULL ? request->query : "", 1);
-    zend_hash_update(props, "query", sizeof("query"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "query", sizeof("query"), &zv, sizeof(zval *), NULL);
 
     MAKE_STD_ZVAL(zv);
     spprintf(&str, 0, "HTTP/%d.%d", request->req->major, request->req->minor);
-    ZVAL_STRING(zv, str, 1);
-    zend_hash_update(props, "protocol", sizeof("protocol"), &zv, sizeof(zval), NULL);
-    efree(str);
+    ZVAL_STRING(zv, str, 0);
+    zend_hash_update(props, "protocol", sizeof("protocol"), &zv, sizeof(zval *), NULL);
 
     MAKE_STD_ZVAL(zv);
     ZVAL_STRING(zv, request->req->remote_host ? request->req->remote_host : "", 1);
-    zend_hash_update(props, "remote_addr", sizeof("remote_addr"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "remote_addr", sizeof("remote_addr"), &zv, sizeof(zval *), NULL);
 
     MAKE_STD_ZVAL(zv);
     ZVAL_LONG(zv, (int)request->req->remote_port);
-    zend_hash_update(props, "remote_port", sizeof("remote_port"), &zv, sizeof(zval), NULL);
-
-    MAKE_STD_ZVAL(zv);
-    array_init(zv);
-    for (header = ((request->req->input_headers)->tqh_first);
-         header; 
-         header = ((header)->next.tqe_next)
-    ) {
-        add_assoc_string(zv, header->key, header->value, 1);
+    zend_hash_update(props, "remote_port", sizeof("remote_port"), &zv, sizeof(zval *), NULL);
+
+    // headers and collections are shared with the request, not copied
+    zv = request_headers(request);
+    Z_ADDREF_P(zv);
+    zend_hash_update(props, "headers", sizeof("headers"), &zv, sizeof(zval *), NULL);
+
+    zv = request_collection(&request->cookies);
+    Z_ADDREF_P(zv);
+    zend_hash_update(props, "cookies", sizeof("cookies"), &zv, sizeof(zval *), NULL);
+
+    zv = request_collection(&request->get);
+    Z_ADDREF_P(zv);
+    zend_hash_update(props, "get", sizeof("get"), &zv, sizeof(zval *), NULL);
+
+    zv = request_collection(&request->post);
+    Z_ADDREF_P(zv);
+    zend_hash_update(props, "post", sizeof("post"), &zv, sizeof(zval *), NULL);
+
+    zv = request_collection(&request->files);
+    Z_ADDREF_P(zv);
+    zend_hash_update(props, "files", sizeof("files"), &zv, sizeof(zval *), NULL);
+
+#ifdef HAVE_JSON
+    // malformed body is shown as null, the error is raised on property read,
+    // body is not decoded while another exception is pending so that one is kept
+    if (EG(exception) == NULL && request_parse_json(request TSRMLS_CC) == FAILURE) {
+        zend_clear_exception(TSRMLS_C);
     }
-    zend_hash_update(props, "headers", sizeof("headers"), &zv, sizeof(zval), NULL);
-
-    MAKE_STD_ZVAL(zv);
-    array_init(zv);
-    if (request->cookies) {
-        zval *tmp;
-        zend_hash_copy(
-            Z_ARRVAL_P(zv), Z_ARRVAL_P(request->cookies),
-            (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-        );
-    }
-    zend_hash_update(props, "cookies", sizeof("cookies"), &zv, sizeof(zval), NULL);
-
-    MAKE_STD_ZVAL(zv);
-    array_init(zv);
-    if (request->get) {
-        zval *tmp;
-        zend_hash_copy(
-            Z_ARRVAL_P(zv), Z_ARRVAL_P(request->get),
-            (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-        );
-    }
-    zend_hash_update(props, "get", sizeof("get"), &zv, sizeof(zval), NULL);
-
-    MAKE_STD_ZVAL(zv);
-    array_init(zv);
-    if (request->post) {
-        zval *tmp;
-        zend_hash_copy(
-            Z_ARRVAL_P(zv), Z_ARRVAL_P(request->post),
-            (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-        );
-    }
-    zend_hash_update(props, "post", sizeof("post"), &zv, sizeof(zval), NULL);
-
-    MAKE_STD_ZVAL(zv);
-    array_init(zv);
-    if (request->files) {
-        zval *tmp;
-        zend_hash_copy(
-            Z_ARRVAL_P(zv), Z_ARRVAL_P(request->files),
-            (copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *)
-        );
+#endif
+    if (request->json != NULL) {
+        zv = request->json;
+        Z_ADDREF_P(zv);
+    } else {
+        MAKE_STD_ZVAL(zv);
+        ZVAL_NULL(zv);
     }
-    zend_hash_update(props, "files", sizeof("files"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "json", sizeof("json"), &zv, sizeof(zval *), NULL);
 
     MAKE_STD_ZVAL(zv);
     ZVAL_LONG(zv, (int)request->status);
-    zend_hash_update(props, "status", sizeof("status"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "status", sizeof("status"), &zv, sizeof(zval *), NULL);
 
     MAKE_STD_ZVAL(zv);
     ZVAL_DOUBLE(zv, request->time);
-    zend_hash_update(props, "time", sizeof("time"), &zv, sizeof(zval), NULL);
+    zend_hash_update(props, "time", sizeof("time"), &zv, sizeof(zval *), NULL);
     
     return props;
 }
@@ -404,6 +583,44 @@ static PHP_METHOD(CanServerRequest, findRequestHeader)
     RETURN_STRING(value, 1);
 }
 
+/**
+ * Get cookie, only the requested cookie is decoded unless all cookies were already parsed
+ */
+static PHP_METHOD(CanServerRequest, getCookie)
+{
+    char *name;
+    int name_len;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "s", &name, &name_len)) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $name)",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    if (request->parsed & PHP_CAN_SERVER_REQUEST_COOKIES) {
+        zval **value;
+        if (request->cookies != NULL 
+                && SUCCESS == zend_hash_find(Z_ARRVAL_P(request->cookies), name, name_len + 1, (void **)&value)) {
+            RETURN_ZVAL(*value, 1, 0);
+        }
+        RETURN_FALSE;
+    }
+
+    const char *cookie = evhttp_find_header(request->req->input_headers, "Cookie");
+    if (cookie == NULL 
+            || FAILURE == php_can_find_cookie(cookie, strlen(cookie), name, name_len, return_value TSRMLS_CC)) {
+        RETURN_FALSE;
+    }
+}
+
 /**
  * Get raw request data
  */
@@ -678,166 +895,364 @@ static PHP_METHOD(CanServerRequest, setCookie)
 }
 
 /**
- * Get realpath of the given path
+ * State of the chunked file transfer
  */
-static char *get_realpath(char *path, int check_is_readable TSRMLS_DC)
+struct php_can_sendfile {
+    struct evhttp_request *req;
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    struct evbuffer_file_segment *segment;
+#endif
+    int fd;
+    long offset;
+    long len;
+    long sent;
+    long chunksize;
+};
+
+static struct php_can_sendfile *sendfile_new(struct evhttp_request *req, int fd, long offset, long len, long chunksize)
 {
-    char resolved_path_buff[MAXPATHLEN];
-    if (VCWD_REALPATH(path, resolved_path_buff)) {
-        if (php_check_open_basedir(resolved_path_buff TSRMLS_CC)) {
-            return NULL;
-        }
-                
-#ifdef R_OK
-        if (check_is_readable == 1 && VCWD_ACCESS(resolved_path_buff, R_OK)) {
-            return NULL;
-        }
+    struct php_can_sendfile *sendfile = emalloc(sizeof(*sendfile));
+
+    sendfile->req = req;
+    sendfile->fd = fd;
+    sendfile->offset = offset;
+    sendfile->len = len;
+    sendfile->sent = 0;
+    sendfile->chunksize = chunksize;
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    // segment is shared by all chunks and closes the file when the last one is written
+    sendfile->segment = evbuffer_file_segment_new(fd, offset, len, EVBUF_FS_CLOSE_ON_FREE);
+    if (sendfile->segment == NULL) {
+        efree(sendfile);
+        return NULL;
+    }
+    sendfile->fd = -1;
 #endif
-        return estrdup(resolved_path_buff);
+    return sendfile;
+}
+
+static void sendfile_free(struct php_can_sendfile *sendfile)
+{
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    // chunks still queued keep their own reference to the segment
+    evbuffer_file_segment_free(sendfile->segment);
+#endif
+    if (sendfile->fd != -1) {
+        close(sendfile->fd);
     }
-    return NULL;
+    efree(sendfile);
 }
 
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+static void sendfile_chunk_done(struct evhttp_connection *evcon, void *arg);
+#endif
+
 /**
- * Send file
+ * Queue next chunk of the file
  */
-static PHP_METHOD(CanServerRequest, sendFile)
+static int sendfile_chunk(struct php_can_sendfile *sendfile)
 {
-    char *filename, *root, *mimetype;
-    int filename_len, root_len = 0, *mimetype_len = 0;
-    zval *download = NULL;
-    long chunksize = 8192; // default chunksize 8 kB
+    long len = (sendfile->sent + sendfile->chunksize) > sendfile->len ? (sendfile->len - sendfile->sent) : sendfile->chunksize;
+    struct evbuffer *buffer = evbuffer_new();
+    int added;
+
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    added = evbuffer_add_file_segment(buffer, sendfile->segment, sendfile->sent, len) == 0;
+#else
+    int chunk_fd = dup(sendfile->fd);
+    added = chunk_fd != -1 
+        && evbuffer_add_file(buffer, chunk_fd, sendfile->offset + sendfile->sent, len) == 0;
+#endif
+    if (added) {
+        sendfile->sent += len;
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+        evhttp_send_reply_chunk_with_cb(sendfile->req, buffer, sendfile_chunk_done, sendfile);
+#else
+        evhttp_send_reply_chunk(sendfile->req, buffer);
+#endif
+    }
+    evbuffer_free(buffer);
+    return added ? SUCCESS : FAILURE;
+}
 
-    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
-            "p|pszl", &filename, &filename_len, &root, &root_len, 
-                     &mimetype, &mimetype_len, &download, &chunksize)
-        || filename_len == 0
-    ) {
-        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
-        php_can_throw_exception(
-            ce_can_InvalidParametersException TSRMLS_CC,
-            "%s%s%s(string $filename[, string $root[, string $mimetype[, string $download[, int $chunksize=10240]]]])",
-            class_name, space, get_active_function_name(TSRMLS_C)
-        );
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+/**
+ * Connection was closed before the whole file was sent
+ */
+static void sendfile_close(struct evhttp_connection *evcon, void *arg)
+{
+    sendfile_free((struct php_can_sendfile *)arg);
+}
+
+/**
+ * Previous chunk was written to the socket, so queue the next one, thus
+ * no more than a single chunk of the file is held by the connection
+ */
+static void sendfile_chunk_done(struct evhttp_connection *evcon, void *arg)
+{
+    struct php_can_sendfile *sendfile = (struct php_can_sendfile *)arg;
+
+    if (sendfile->sent < sendfile->len && sendfile_chunk(sendfile) == SUCCESS) {
         return;
     }
-    
-    // do not serve requests for files begins with ``/..`` or ``../``
-    if (0 == php_can_strpos(filename, "/..", 0) || 0 == php_can_strpos(filename, "../", 0)) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 400, "Bogus file requested '%s'", filename
-        );
-        return;
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+    evhttp_send_reply_end(sendfile->req);
+    sendfile_free(sendfile);
+}
+#endif
+
+/**
+ * Start chunked file transfer, reply must be already started
+ */
+static void sendfile_start(struct php_can_sendfile *sendfile)
+{
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+    struct evhttp_connection *evcon = evhttp_request_get_connection(sendfile->req);
+
+    evhttp_connection_set_closecb(evcon, sendfile_close, sendfile);
+    if (sendfile_chunk(sendfile) == FAILURE) {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        evhttp_send_reply_end(sendfile->req);
+        sendfile_free(sendfile);
     }
-    
-    // try to determine real path of the given root
-    char *rootpath = NULL;
-    if (root_len > 0) {
-        rootpath = get_realpath(root, 1 TSRMLS_CC);
-        if (rootpath == NULL) {
-            const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
-            php_can_throw_exception(
-                ce_can_InvalidParametersException TSRMLS_CC,
-                "%s%s%s(): Cannot determine real path of $root value '%s'",
-                class_name, space, get_active_function_name(TSRMLS_C),
-                root
-            );
-            return;
+#else
+    while (sendfile->sent < sendfile->len && sendfile_chunk(sendfile) == SUCCESS);
+    evhttp_send_reply_end(sendfile->req);
+    sendfile_free(sendfile);
+#endif
+}
+
+/**
+ * Parse value of the Range header, returns number of satisfiable ranges, 0 if
+ * none of them is satisfiable or -1 if the header must be ignored because it
+ * is malformed, has too many ranges or requests more bytes than the file has
+ */
+static int ranges_parse(const char *header, long size, struct php_can_range *ranges, int max)
+{
+    const char *p = header;
+    long total = 0;
+    int count = 0, specs = 0;
+
+    while (*p == ' ') p++;
+    if (strncasecmp(p, "bytes=", sizeof("bytes=") - 1) != 0) {
+        return -1;
+    }
+    p += sizeof("bytes=") - 1;
+
+    while (1) {
+        long from = -1, to = -1;
+        int digits;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') {
+            break;
+        }
+
+        for (digits = 0; *p >= '0' && *p <= '9'; p++, digits++) {
+            if (digits == 18) {
+                return -1;
+            }
+            from = (from == -1 ? 0 : from * 10) + (*p - '0');
+        }
+        if (*p++ != '-') {
+            return -1;
+        }
+        for (digits = 0; *p >= '0' && *p <= '9'; p++, digits++) {
+            if (digits == 18) {
+                return -1;
+            }
+            to = (to == -1 ? 0 : to * 10) + (*p - '0');
         }
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p != ',' && *p != '\0') {
+            return -1;
+        }
+        specs++;
+
+        if (from == -1) {
+            // bytes=-100 -> last 100 bytes
+            if (to == -1) {
+                return -1;
+            }
+            if (to == 0 || size == 0) {
+                continue;
+            }
+            from = MAX(0, size - to);
+            to = size - 1;
+        } else {
+            // bytes=100- -> from 100th byte to the end, bytes=100-200 -> bytes 100-200 (inclusive)
+            if (to != -1 && to < from) {
+                return -1;
+            }
+            if (from >= size) {
+                continue;
+            }
+            to = to == -1 ? size - 1 : MIN(to, size - 1);
+        }
+
+        if (count == max) {
+            return -1;
+        }
+        ranges[count].from = from;
+        ranges[count].len = to - from + 1;
+        total += ranges[count].len;
+        count++;
     }
-    
-    // try to determine real path of the root+file
-    char *tmppath = NULL;
-    spprintf(&tmppath, 0, "%s%s%s", rootpath ? rootpath : "", (rootpath && filename[0] != '/' ? "/" : ""), filename);
 
-    // resolve realpath of the requested file
-    char *filepath = get_realpath(tmppath, 0 TSRMLS_CC);
-    if (filepath == NULL) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 404, "Requested file '%s' does not exist", tmppath
-        );
-        efree(tmppath);
-        efree(rootpath);
-        return;
+    // overlapping ranges asking for more than the whole file are served as the whole file
+    if (specs == 0 || (count > 1 && total > size)) {
+        return -1;
     }
-    efree(tmppath);
-    
-    // requested file exists, we check if file is within root path, 
-    // otherwise we send 404 File Not Found to prevent giving informations 
-    // about existence of this file on the server machine. This check prevents 
-    // serving of the symlinks to outside of the root path as well.
-    if (0 != php_can_strpos(filepath, rootpath, 0)) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 404, "Requested file '%s' is not within root path '%s'", filepath, rootpath
-        );
-        efree(filepath);
-        efree(rootpath);
+    return count;
+}
+
+/**
+ * Check If-Range header, which must be the current strong ETag or the exact
+ * modification date of the file for the Range header to be applied
+ */
+static int if_range_matches(struct evhttp_request *req, struct php_can_file *file)
+{
+    const char *if_range = evhttp_find_header(req->input_headers, "If-Range");
+
+    if (if_range == NULL) {
+        return 1;
+    }
+    if (if_range[0] == '"') {
+        return strcmp(if_range, file->etag) == 0;
+    }
+    if (if_range[0] == 'W' && if_range[1] == '/') {
+        // weak validators never match
+        return 0;
+    }
+    return php_can_http_date_parse(if_range) == file->st.st_mtime;
+}
+
+/**
+ * Send several ranges of the file as multipart/byteranges response, parts
+ * refer to the file instead of carrying a copy of it
+ */
+static int sendfile_ranges(struct php_can_server_request *request, int fd, struct php_can_file *file, 
+        struct php_can_range *ranges, int count)
+{
+    static unsigned long boundary_seq = 0;
+    char boundary[32], *content_type, *multipart_type = NULL;
+    struct evbuffer *buffer;
+    int i, added = 1;
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    struct evbuffer_file_segment *segment;
+    int segment_fd = dup(fd);
+
+    if (segment_fd == -1) {
+        return FAILURE;
+    }
+    // all parts share the segment, it closes the file when the last part is written
+    segment = evbuffer_file_segment_new(segment_fd, 0, file->st.st_size, EVBUF_FS_CLOSE_ON_FREE);
+    if (segment == NULL) {
+        close(segment_fd);
+        return FAILURE;
+    }
+#endif
+
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx", (unsigned long)time(NULL), ++boundary_seq);
+
+    // every part carries the type of the file, response gets multipart type
+    const char *type = evhttp_find_header(request->req->output_headers, "Content-Type");
+    content_type = estrdup(type ? type : "application/octet-stream");
+    evhttp_remove_header(request->req->output_headers, "Content-Type");
+    spprintf(&multipart_type, 0, "multipart/byteranges; boundary=%s", boundary);
+    evhttp_add_header(request->req->output_headers, "Content-Type", multipart_type);
+    efree(multipart_type);
+
+    buffer = evbuffer_new();
+    for (i = 0; i < count && added; i++) {
+        evbuffer_add_printf(buffer, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+            boundary, content_type, ranges[i].from, ranges[i].from + ranges[i].len - 1, (long)file->st.st_size);
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+        added = evbuffer_add_file_segment(buffer, segment, ranges[i].from, ranges[i].len) == 0;
+#else
+        int part_fd = dup(fd);
+        added = part_fd != -1 && evbuffer_add_file(buffer, part_fd, ranges[i].from, ranges[i].len) == 0;
+        if (!added && part_fd != -1) {
+            // libevent owns the descriptor only once it is added
+            close(part_fd);
+        }
+#endif
+    }
+    evbuffer_add_printf(buffer, "\r\n--%s--\r\n", boundary);
+    efree(content_type);
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+    // queued parts keep their own references to the segment
+    evbuffer_file_segment_free(segment);
+#endif
+
+    if (added) {
+        request->response_len = EVBUFFER_LENGTH(buffer);
+        evhttp_send_reply(request->req, request->response_status, NULL, buffer);
+    }
+    evbuffer_free(buffer);
+    return added ? SUCCESS : FAILURE;
+}
+
+/**
+ * Send file within the root as response to the request, HTTPError
+ * is thrown if file cannot be served
+ */
+void php_can_send_file(struct php_can_server_request *request, char *filename, int filename_len, 
+        char *root, int root_len, zend_bool root_resolved, char *mimetype, int mimetype_len, 
+        zval *download, long chunksize TSRMLS_DC)
+{
+    if (request->refresh) {
+        // response refreshing the route cache is never sent, files are not cached
+        request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
         return;
     }
-    
-    efree(rootpath);
-    
-#ifdef R_OK
-    // requested path exists and is within root path, check for read permissions
-    if (VCWD_ACCESS(filepath, R_OK)) {
+    // file is the response, so the handler has set its headers already
+    php_can_http_date_header(request->req);
+
+    // do not serve requests for files begins with ``/..`` or ``../``
+    if (0 == php_can_strpos(filename, "/..", 0) || 0 == php_can_strpos(filename, "../", 0)) {
         php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 403, "Requested file '%s' is not readable", filepath
+            ce_can_HTTPError TSRMLS_CC, 400, "Bogus file requested '%s'", filename
         );
-        efree(filepath);
         return;
     }
-#endif
     
-    // open stream to the requested path
-    int flags = (
-        STREAM_MUST_SEEK                // we gonna seek within stream
-        | STREAM_DISABLE_OPEN_BASEDIR   // we have already checked for open_base dir, so skip it
-        | STREAM_ASSUME_REALPATH        // assume the path passed in exists and is fully expanded, avoiding syscalls
-        | STREAM_DISABLE_URL_PROTECTION // skip allow_url_fopen and allow_url_include checks
-        | REPORT_ERRORS
-    );
-    php_stream *stream = php_stream_open_wrapper(filepath, "rb", flags, NULL);
-    if (!stream) {
-        php_can_throw_exception(
-            ce_can_RuntimeException TSRMLS_CC,
-            "Cannot read content of the file '%s'", filepath
-        );
-        efree(filepath);
+    // resolve the file within the root, hot files come from the file cache
+    struct php_can_file *file = php_can_file_open(root, root_len, root_resolved, filename, filename_len TSRMLS_CC);
+    if (file == NULL) {
         return;
     }
-    
-    // get stream stats
-    php_stream_statbuf st;
-    if (php_stream_stat(stream, &st) < 0) {
+
+    // libevent takes over the descriptor it is given, so hand it a duplicate
+    // and keep the cached one open
+    int fd = dup(file->fd);
+    if (fd == -1) {
         php_can_throw_exception(
             ce_can_RuntimeException TSRMLS_CC,
-            "Cannot stat of the file '%s'", filepath
+            "Cannot read content of the file '%s'", file->path
         );
-        efree(filepath);
+        php_can_file_release(file);
         return;
     }
     
-    // we do not serving directory listings, so if requested URI points to directory
-    // we send 403 Forbidden response to the client
-    if (S_ISDIR(st.sb.st_mode)) {
-        php_can_throw_exception_code(
-            ce_can_HTTPError TSRMLS_CC, 403, "Requested path '%s' is a directory", filepath
-        );
-        php_stream_close(stream);
-        efree(filepath);
-        return;
-    }
-    
-    struct php_can_server_request *request = (struct php_can_server_request*)
-        zend_object_store_get_object(getThis() TSRMLS_CC);
-    
     // handle $mimetype
-    if (mimetype_len == 0) {
-        // $mimtype was not given, so try to determine mimetype with finfo
+    const char *known_mimetype = NULL;
+    if (mimetype_len == 0 && file->mimetype == NULL) {
+        known_mimetype = php_can_mimetype(file->path, strlen(file->path));
+    }
+    if (mimetype_len == 0 && file->mimetype) {
+        // mimetype was already determined for the cached file
+        evhttp_add_header(request->req->output_headers, "Content-Type", file->mimetype);
+    } else if (known_mimetype) {
+        // mimetype is known by the file extension
+        evhttp_add_header(request->req->output_headers, "Content-Type", known_mimetype);
+    } else if (mimetype_len == 0) {
+        // $mimtype was not given and extension is unknown, so try to determine mimetype
+        // with finfo, result is kept with the cached file
         zend_class_entry **cep;
         if (zend_lookup_class_ex("\\finfo", sizeof("\\finfo") - 1, NULL, 0, &cep TSRMLS_CC) == SUCCESS) {
 
-            zval *retval_ptr, *object, **params[1], *arg, *zfilepath, *retval;
+            zval *retval_ptr, *object, **params[1], *arg, *zfilepath, *retval = NULL;
             zend_fcall_info fci;
             zend_fcall_info_cache fcc;
             zend_class_entry *ce = *cep;
@@ -878,40 +1293,36 @@ static PHP_METHOD(CanServerRequest, sendFile)
                     "Failed to call '%s' constructor",
                     ce->name
                 );
-                efree(filepath);
+                close(fd);
+                php_can_file_release(file);
                 return;
             }
             
             // call finfo->file(filename)
             MAKE_STD_ZVAL(zfilepath);
-            ZVAL_STRING(zfilepath, filepath, 1);
+            ZVAL_STRING(zfilepath, file->path, 1);
             zend_call_method_with_1_params(&object, Z_OBJCE_P(object), NULL, "file", &retval, zfilepath);
             zval_ptr_dtor(&zfilepath);
             if (EG(exception)) {
-                efree(filepath);
+                if (retval) {
+                    zval_ptr_dtor(&retval);
+                }
+                zval_ptr_dtor(&object);
+                close(fd);
+                php_can_file_release(file);
                 return;
             }
 
-            // workaround for CSS files bug in magic library. If css file beginns with C-style comments
-            // magic returns text/x-c as mimetype - we rewright it to test/css if the file has .css extension
-            if (0 == php_can_strpos(Z_STRVAL_P(retval), "text/x-c;", 0)) {
-                char *ext = php_can_substr(filepath, -5, 5);
-                if (ext != NULL) {
-                    if (0 == strcasecmp(ext, ".css")) {
-                        int mime_len = sizeof("text/x-c;") - 1;
-                        char *encoding = php_can_substr(Z_STRVAL_P(retval), mime_len, Z_STRLEN_P(retval) - mime_len);
-                        if (encoding != NULL) {
-                            efree(Z_STRVAL_P(retval));
-                            Z_STRLEN_P(retval) = spprintf(&(Z_STRVAL_P(retval)), 0, "text/css;%s", encoding);
-                            efree(encoding);
-                        }
-                    }
-                    efree(ext);
-                }
+            if (retval && Z_TYPE_P(retval) == IS_STRING && Z_STRLEN_P(retval) > 0) {
+                evhttp_add_header(request->req->output_headers, "Content-Type", Z_STRVAL_P(retval));
+                file->mimetype = estrndup(Z_STRVAL_P(retval), Z_STRLEN_P(retval));
+            } else {
+                // finfo failed, type is not cached so it is detected again next time
+                evhttp_add_header(request->req->output_headers, "Content-Type", "application/octet-stream");
+            }
+            if (retval) {
+                zval_ptr_dtor(&retval);
             }
-            
-            evhttp_add_header(request->req->output_headers, "Content-Type", Z_STRVAL_P(retval));
-            zval_ptr_dtor(&retval);
             zval_ptr_dtor(&object);
             
         } else {
@@ -930,7 +1341,7 @@ static PHP_METHOD(CanServerRequest, sendFile)
         size_t basename_len;
         if (Z_TYPE_P(download) == IS_BOOL && Z_BVAL_P(download) == 1) { 
             // $download is true, determine basename of the file
-            php_basename(filepath, strlen(filepath), NULL, 0, &basename, &basename_len TSRMLS_CC);
+            php_basename(file->path, strlen(file->path), NULL, 0, &basename, &basename_len TSRMLS_CC);
         } else if (Z_TYPE_P(download) == IS_STRING) {
             // $download is filename
             basename = estrndup(Z_STRVAL_P(download), Z_STRLEN_P(download));
@@ -941,19 +1352,43 @@ static PHP_METHOD(CanServerRequest, sendFile)
             efree(basename);
         }
     }
-    efree(filepath);
+    
+    // serve precompressed sibling of the file if client accepts its encoding,
+    // responses differ by Accept-Encoding whenever the file has any sibling
+    static const char *encodings[PHP_CAN_FILE_ENCODINGS] = {"br", "gzip"};
+    const char *accept_encoding = evhttp_find_header(request->req->input_headers, "Accept-Encoding");
+    struct php_can_file *content = file;
+    int encoding, vary = 0;
+    for (encoding = 0; encoding < PHP_CAN_FILE_ENCODINGS; encoding++) {
+        struct php_can_file *variant = php_can_file_variant(file, encoding TSRMLS_CC);
+        if (variant == NULL) {
+            continue;
+        }
+        vary = 1;
+        if (content == file && accept_encoding != NULL && php_can_accepts_encoding(accept_encoding, encodings[encoding])) {
+            int variant_fd = dup(variant->fd);
+            if (variant_fd != -1) {
+                close(fd);
+                fd = variant_fd;
+                content = variant;
+                evhttp_add_header(request->req->output_headers, "Content-Encoding", encodings[encoding]);
+            }
+        }
+    }
+    if (vary) {
+        evhttp_add_header(request->req->output_headers, "Vary", "Accept-Encoding");
+    }
     
     // add Accept-Ranges header to notify client that we can handle renged requests
     evhttp_add_header(request->req->output_headers, "Accept-Ranges", "bytes");
     
-    // generate and ETag
-    char *etag = NULL;
-    spprintf(&etag, 0, "\"%x-%x-%x\"", (int)st.sb.st_ino, (int)st.sb.st_mtime, (int)st.sb.st_size);
+    // add ETag generated when the file was resolved
+    const char *etag = content->etag;
     evhttp_add_header(request->req->output_headers, "ETag", etag);
 
     // check if client gave us ETag in header
     const char *client_etag = evhttp_find_header(request->req->input_headers, "If-None-Match");
-    if (client_etag != NULL && strcmp(client_etag, etag) == 0) {
+    if (client_etag != NULL && php_can_etag_matches(client_etag, etag)) {
         
         // ETags are the same 
         request->response_status = 304;
@@ -963,24 +1398,9 @@ static PHP_METHOD(CanServerRequest, sendFile)
         
         // ETag is not the same or unknown, so check client's modification stamp
         const char *client_lm = evhttp_find_header(request->req->input_headers, "If-Modified-Since");
-        int client_ts = 0;
-        if (client_lm != NULL) {
-            zval retval, *strtotime, *time, *args[1];
-            MAKE_STD_ZVAL(strtotime); ZVAL_STRING(strtotime, "strtotime", 1);
-            MAKE_STD_ZVAL(time); ZVAL_STRING(time, client_lm, 1);
-            args[0] = time; Z_ADDREF_P(args[0]);
-            if (call_user_function(EG(function_table), NULL, strtotime, &retval, 1, args TSRMLS_CC) == SUCCESS) {
-                if (Z_TYPE(retval) == IS_LONG) {
-                    client_ts = Z_LVAL(retval);
-                }
-                zval_dtor(&retval);
-            }
-            Z_DELREF_P(args[0]);
-            zval_ptr_dtor(&time);
-            zval_ptr_dtor(&strtotime);
-        }
+        time_t client_ts = client_lm != NULL ? php_can_http_date_parse(client_lm) : -1;
         
-        if (client_ts >= st.sb.st_mtime) {
+        if (client_ts >= content->st.st_mtime) {
             
             // modification falg of the file is older than client's stamp
             // so send "Not Modified" response
@@ -989,146 +1409,117 @@ static PHP_METHOD(CanServerRequest, sendFile)
 
         } else {
 
-            // generate and add Last-Modified header
-            char *lm = NULL;
-            zval retval, *gmstrftime, *format, *timestamp, *args[2];
-            MAKE_STD_ZVAL(gmstrftime); ZVAL_STRING(gmstrftime, "gmstrftime", 1);
-            MAKE_STD_ZVAL(format); ZVAL_STRING(format, "%a, %d %b %Y %H:%M:%S GMT", 1);
-            MAKE_STD_ZVAL(timestamp); ZVAL_LONG(timestamp, st.sb.st_mtime);
-            args[0] = format; args[1] = timestamp;
-            Z_ADDREF_P(args[0]); Z_ADDREF_P(args[1]);
-            if (call_user_function(EG(function_table), NULL, gmstrftime, &retval, 2, args TSRMLS_CC) == SUCCESS) {
-                if (Z_TYPE(retval) == IS_STRING) {
-                    lm = estrndup(Z_STRVAL(retval), Z_STRLEN(retval));
-                }
-                zval_dtor(&retval);
-            }
-            Z_DELREF_P(args[0]); Z_DELREF_P(args[1]);
-            zval_ptr_dtor(&format);
-            zval_ptr_dtor(&timestamp);
-            zval_ptr_dtor(&gmstrftime);
-        
-            if (lm != NULL) {
-                evhttp_add_header(request->req->output_headers, "Last-Modified", lm);
-                efree(lm);
-            }
+            // add Last-Modified header generated when the file was resolved
+            evhttp_add_header(request->req->output_headers, "Last-Modified", content->last_modified);
             
             // if request method is HEAD, just add Content-Length header
             // and send respinse without body
             if (request->req->type == EVHTTP_REQ_HEAD) {
                 request->response_status = 200;
                 char *size = NULL;
-                spprintf(&size, 0, "%ld", (long)st.sb.st_size);
+                spprintf(&size, 0, "%ld", (long)content->st.st_size);
                 evhttp_add_header(request->req->output_headers, "Content-Length", size);
                 evhttp_send_reply(request->req, request->response_status, NULL, NULL);
                 efree(size);
             } else {
             
-                // check if the client requested the ranged content
-                long range_from = 0, range_to = st.sb.st_size, range_len;
-                char *range = (char *)evhttp_find_header(request->req->input_headers, "Range");
-                if (range != NULL) {
-                    int pos = php_can_strpos(range, "bytes=", 0);
-                    if (FAILURE != pos) {
-                        int part_len =  strlen(range) - 6;
-                        char * part = php_can_substr(range, 6, part_len);
-                        if (part != NULL) {
-                            char start[part_len], end[part_len];
-                            int is_end = 0, i, y = 0;
-                            for(i = 0; i < part_len; i++) {
-                                if (part[i] == '-') {
-                                    is_end = 1;
-                                    start[i] = '\0';
-                                    continue;
-                                }
-                                if (is_end) {
-                                    end[y++] = part[i];
-                                } else {
-                                    start[i] = part[i];
-                                }
-                            }
-                            end[y] = '\0';
-                            efree(part);
-
-                            if (strlen(start) == 0) {
-                                // bytes=-100 -> last 100 bytes
-                                range_from = MAX(0, st.sb.st_size - atol(end));
-                                range_to = st.sb.st_size;
-                            } else if (strlen(end) == 0) {
-                                // bytes=100- -> all but the first 99 bytes
-                                range_from = atol(start);
-                                range_to = st.sb.st_size;
-                            } else {
-                                // bytes=100-200 -> bytes 100-200 (inclusive)
-                                range_from = atol(start);
-                                range_to = MIN(atol(end) + 1, st.sb.st_size);
-                            }
-                        }
-                    }
+                // check if the client requested the ranged content, Range is
+                // ignored if the If-Range validator does not match the file
+                struct php_can_range ranges[PHP_CAN_SERVER_MAX_RANGES];
+                int ranges_count = -1;
+                const char *range = evhttp_find_header(request->req->input_headers, "Range");
+                if (range != NULL && if_range_matches(request->req, content)) {
+                    ranges_count = ranges_parse(range, (long)content->st.st_size, ranges, PHP_CAN_SERVER_MAX_RANGES);
                 }
 
-                range_len = range_to - range_from;
-                if (range_len <= 0) {
+                if (ranges_count == 0) {
 
-                    // requested range is not valid, so send appropriate
+                    // none of the requested ranges is satisfiable, so send appropriate
                     // response "Requested Range not satisfiable"
+                    char *content_range = NULL;
+                    spprintf(&content_range, 0, "bytes */%ld", (long)content->st.st_size);
+                    evhttp_add_header(request->req->output_headers, "Content-Range", content_range);
+                    efree(content_range);
                     request->response_status = 416;
                     evhttp_send_reply(request->req, request->response_status, NULL, NULL);
 
+                } else if (ranges_count > 1) {
+
+                    // several ranges requested, send them as multipart/byteranges
+                    // where every part refers to the file range
+                    request->response_status = 206;
+                    if (sendfile_ranges(request, fd, content, ranges, ranges_count) == FAILURE) {
+                        request->response_status = 500;
+                        evhttp_send_reply(request->req, request->response_status, NULL, NULL);
+                    }
+
                 } else {
 
-                    // set response code to 206 if partial content requested, to 200 otherwise
-                    request->response_status = range_len != st.sb.st_size ? 206 : 200;
+                    // set response code to 206 if single range requested, to 200 otherwise
+                    long range_from = 0, range_len = (long)content->st.st_size;
+                    if (ranges_count == 1) {
+                        char *content_range = NULL;
+                        range_from = ranges[0].from;
+                        range_len = ranges[0].len;
+                        spprintf(&content_range, 0, "bytes %ld-%ld/%ld", 
+                            range_from, range_from + range_len - 1, (long)content->st.st_size);
+                        evhttp_add_header(request->req->output_headers, "Content-Range", content_range);
+                        efree(content_range);
+                        request->response_status = 206;
+                    } else {
+                        request->response_status = 200;
+                    }
                     
+                    // whole small file may be kept in memory
+                    struct evbuffer *memory = ranges_count == 1 ? NULL : php_can_file_content(content TSRMLS_CC);
+
                     // if requested range is smaller then chunksize,
                     // do not use chunked transfer encoding
-                    if (chunksize == 0 || range_len <= chunksize) {
-
-                        char *content;
-                        php_stream_seek(stream, range_from, SEEK_SET );
-                        int content_len = php_stream_copy_to_mem(stream, &content, range_len, 0);
-                        if (request->response_status == 206) {
-                            char *range = NULL;
-                            spprintf(&range, 0, "bytes %ld-%ld/%ld", range_from, range_to, (long)st.sb.st_size);
-                            evhttp_add_header(request->req->output_headers, "Content-Range", range);
-                            efree(range);
-                        }
-                        request->response_len = content_len;
+                    if (range_len == 0) {
+
+                        evhttp_send_reply(request->req, request->response_status, NULL, NULL);
+
+                    } else if (memory != NULL) {
+
+                        // reply refers to the content kept in memory instead of copying it
                         struct evbuffer *buffer = evbuffer_new();
-                        evbuffer_add(buffer, content, content_len);
-                        evhttp_send_reply(request->req, 200, NULL, buffer);
+#ifdef HAVE_EVBUFFER_ADD_BUFFER_REFERENCE
+                        evbuffer_add_buffer_reference(buffer, memory);
+#endif
+                        request->response_len = range_len;
+                        evhttp_send_reply(request->req, request->response_status, NULL, buffer);
+                        evbuffer_free(buffer);
+
+                    } else if (chunksize == 0 || range_len <= chunksize) {
+
+                        struct evbuffer *buffer = evbuffer_new();
+                        // libevent takes over the descriptor and sends the range with sendfile or mmap
+                        if (evbuffer_add_file(buffer, fd, range_from, range_len) == 0) {
+                            fd = -1;
+                            request->response_len = range_len;
+                            evhttp_send_reply(request->req, request->response_status, NULL, buffer);
+                        } else {
+                            request->response_status = 500;
+                            evhttp_send_reply(request->req, request->response_status, NULL, NULL);
+                        }
                         evbuffer_free(buffer);
-                        efree(content);
 
                     } else {
 
-                        // send contentas chunkd transfer encoding
-                        long pos = range_from, len;
-                        char *chunk;
-                        while(-1 != php_stream_seek(stream, pos, SEEK_SET )) {
-                            if (pos == range_from) {
-                                request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENDING;
-                                request->response_len = 0;
-                                evhttp_send_reply_start(request->req, request->response_status, NULL);
-                            }
-                            int len = (request->response_len + chunksize) > range_len ? (range_len - request->response_len) : chunksize;
-                            int chunk_len = php_stream_copy_to_mem(stream, &chunk, len, 0);
-                            if (chunk_len == 0) {
-                                efree(chunk);
-                                break;
-                            }
-                            struct evbuffer *buffer = evbuffer_new();
-                            evbuffer_add(buffer, chunk, chunk_len);
-                            evhttp_send_reply_chunk(request->req, buffer);
-                            evbuffer_free(buffer);
-                            efree(chunk);
-                            request->response_len += chunk_len;
-                            pos += chunk_len;
-                            if (request->response_len == range_len) {
-                                break;
-                            }
+                        // send content as chunked transfer encoding, every chunk refers
+                        // to the file range instead of carrying a copy of it
+                        struct php_can_sendfile *sendfile = sendfile_new(request->req, fd, range_from, range_len, chunksize);
+                        if (sendfile != NULL) {
+                            fd = -1;
+                        }
+                        request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENDING;
+                        request->response_len = range_len;
+                        evhttp_send_reply_start(request->req, request->response_status, NULL);
+                        if (sendfile == NULL) {
+                            evhttp_send_reply_end(request->req);
+                        } else {
+                            sendfile_start(sendfile);
                         }
-                        evhttp_send_reply_end(request->req);
                     }
                 }
             }
@@ -1136,13 +1527,47 @@ static PHP_METHOD(CanServerRequest, sendFile)
     }
     request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
     
-    efree(etag);
-    php_stream_close(stream);
+    php_can_file_release(file);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Send file
+ */
+static PHP_METHOD(CanServerRequest, sendFile)
+{
+    char *filename, *root = NULL, *mimetype = NULL;
+    int filename_len, root_len = 0, mimetype_len = 0;
+    zval *download = NULL;
+    long chunksize = 8192; // default chunksize 8 kB
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "p|pszl", &filename, &filename_len, &root, &root_len, 
+                     &mimetype, &mimetype_len, &download, &chunksize)
+        || filename_len == 0
+    ) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $filename[, string $root[, string $mimetype[, string $download[, int $chunksize=10240]]]])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    struct php_can_server_request *request = (struct php_can_server_request*)
+        zend_object_store_get_object(getThis() TSRMLS_CC);
+
+    php_can_send_file(request, filename, filename_len, root, root_len, 0,
+        mimetype, mimetype_len, download, chunksize TSRMLS_CC);
 }
 
 static zend_function_entry server_request_methods[] = {
     PHP_ME(CanServerRequest, __construct,          NULL, ZEND_ACC_FINAL | ZEND_ACC_PROTECTED)
     PHP_ME(CanServerRequest, findRequestHeader,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRequest, getCookie,            NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, getRequestBody,       NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, addResponseHeader,    NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRequest, removeResponseHeader, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
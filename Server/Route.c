@@ -31,10 +31,32 @@ static zend_object_value server_route_ctor(zend_class_entry *ce TSRMLS_DC)
     route = ecalloc(1, sizeof(*route));
     zend_object_std_init(&route->std, ce TSRMLS_CC);
     route->handler = NULL;
+    route->body_handler = NULL;
+    route->progress_handler = NULL;
+    route->storage_handler = NULL;
+    route->progress_interval = PHP_CAN_SERVER_PROGRESS_INTERVAL;
+    route->body_methods = PHP_CAN_SERVER_ROUTE_METHOD_POST;
+    route->json_max_size = SG(post_max_size);
+    route->json_max_depth = PHP_CAN_SERVER_JSON_MAX_DEPTH;
+    route->upload_memory_limit = 0;
+    route->upload_max_filesize = PG(upload_max_filesize);
+    route->field_max_size = PHP_CAN_SERVER_FIELD_MAX_SIZE;
+    route->post_max_size = SG(post_max_size);
+    route->large_body = 0;
     route->methods = 0;
     route->regexp = NULL;
     route->route = NULL;
     route->casts = NULL;
+    route->static_root = NULL;
+    route->static_param = NULL;
+    route->static_chunksize = PHP_CAN_SERVER_STATIC_CHUNKSIZE;
+    route->cache_ttl = 0;
+    route->cache_stale = 0;
+    route->cache_max_size = PHP_CAN_SERVER_CACHE_MAX_SIZE;
+    route->cache_len = 0;
+    route->cache_vary = NULL;
+    route->cache = NULL;
+    route->etag = 0;
     retval.handle = zend_objects_store_put(route,
             (zend_objects_store_dtor_t)zend_objects_destroy_object,
             server_route_dtor,
@@ -51,6 +73,18 @@ static void server_route_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&route->handler);
     }
 
+    if (route->body_handler) {
+        zval_ptr_dtor(&route->body_handler);
+    }
+
+    if (route->progress_handler) {
+        zval_ptr_dtor(&route->progress_handler);
+    }
+
+    if (route->storage_handler) {
+        zval_ptr_dtor(&route->storage_handler);
+    }
+
     if (route->regexp) {
         efree(route->regexp);
         route->regexp = NULL;
@@ -65,28 +99,107 @@ static void server_route_dtor(void *object TSRMLS_DC)
         zval_ptr_dtor(&route->casts);
     }
 
+    if (route->static_root) {
+        efree(route->static_root);
+    }
+
+    if (route->static_param) {
+        efree(route->static_param);
+    }
+
+    if (route->cache_vary) {
+        zval_ptr_dtor(&route->cache_vary);
+    }
+
+    php_can_cache_free(route);
+
     zend_objects_store_del_ref(&route->refhandle TSRMLS_CC);
     zend_object_std_dtor(&route->std TSRMLS_CC);
     efree(route);
 
 }
 
+/**
+ * Read integer option if it is given, values below min are raised to min
+ */
+static void route_option_long(zval *options, const char *name, long *dst, long min)
+{
+    zval **option;
+
+    if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), (char *)name, strlen(name) + 1, (void **)&option)) {
+        zval tmp = **option;
+        zval_copy_ctor(&tmp);
+        convert_to_long(&tmp);
+        *dst = Z_LVAL(tmp) > min ? Z_LVAL(tmp) : min;
+    }
+}
+
+/**
+ * Compile route URI into the regular expression and param casts
+ */
+static void route_compile(struct php_can_server_route *route, char *uri, int uri_len TSRMLS_DC)
+{
+    MAKE_STD_ZVAL(route->casts);
+    array_init(route->casts);
+    
+    if (FAILURE != php_can_strpos(uri, "<", 0) && FAILURE != php_can_strpos(uri, ">", 0)) {
+        int i;
+        for (i = 0; i < uri_len; i++) {
+            if (uri[i] != '<') {
+                spprintf(&route->regexp, 0, "%s%c", route->regexp == NULL ? "" : route->regexp, uri[i]);
+            } else {
+                int y = php_can_strpos(uri, ">", i);
+                char *name = php_can_substr(uri, i + 1, y - (i + 1));
+                int pos = php_can_strpos(name, ":", 0);
+                if (FAILURE != pos) {
+                    char *var = php_can_substr(name, 0, pos);
+                    char *filter = php_can_substr(name, pos + 1, strlen(name) - (pos + 1));
+                    if (strcmp(filter, "int") == 0) {
+                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9]+");
+                        add_assoc_long(route->casts, var, IS_LONG);
+                    } else if (0 == strcmp(filter, "float")) {
+                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, "-?[0-9.]+");
+                        add_assoc_long(route->casts, var, IS_DOUBLE);
+                    } else if (0 == strcmp(filter, "path")) {
+                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, ".+?");
+                        add_assoc_long(route->casts, var, IS_PATH);
+                    } else if (0 == (pos = php_can_strpos(filter, "re:", 0))) {
+                        char *reg = php_can_substr(filter, pos + 3, strlen(filter) - (pos + 3));
+                        spprintf(&route->regexp, 0, "%s(?<%s>%s)", route->regexp, var, reg);
+                        efree(reg);
+                    }
+                    efree(filter);
+                    efree(var);
+                    
+                } else {
+                    spprintf(&route->regexp, 0, "%s(?<%s>[^/]+)", route->regexp, name);
+                }
+                efree(name);
+                i = y;
+            }
+        }
+        spprintf(&route->regexp, 0, "\1^%s$\1", route->regexp);
+    }
+    
+    route->route = estrndup(uri, uri_len);
+}
+
 /**
  * Constructor
  */
 static PHP_METHOD(CanServerRoute, __construct)
 {
     char *route;
-    zval *handler;
+    zval *handler, *options = NULL;
     int route_len;
     long methods = PHP_CAN_SERVER_ROUTE_METHOD_GET;
 
     if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
-            "sz|l", &route, &route_len, &handler, &methods)) {
+            "sz|la", &route, &route_len, &handler, &methods, &options)) {
         const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
         php_can_throw_exception(
             ce_can_InvalidParametersException TSRMLS_CC,
-            "%s%s%s(string $route, mixed $handler[, int $methods = Route::METHOD_GET])",
+            "%s%s%s(string $route, mixed $handler[, int $methods = Route::METHOD_GET[, array $options]])",
             class_name, space, get_active_function_name(TSRMLS_C)
         );
         return;
@@ -110,50 +223,165 @@ static PHP_METHOD(CanServerRoute, __construct)
     
     zval_add_ref(&handler);
     request->handler = handler;
-    
-    MAKE_STD_ZVAL(request->casts);
-    array_init(request->casts);
-    
-    if (FAILURE != php_can_strpos(route, "<", 0) && FAILURE != php_can_strpos(route, ">", 0)) {
-        int i;
-        for (i = 0; i < route_len; i++) {
-            if (route[i] != '<') {
-                spprintf(&request->regexp, 0, "%s%c", request->regexp == NULL ? "" : request->regexp, route[i]);
-            } else {
-                int y = php_can_strpos(route, ">", i);
-                char *name = php_can_substr(route, i + 1, y - (i + 1));
-                int pos = php_can_strpos(name, ":", 0);
-                if (FAILURE != pos) {
-                    char *var = php_can_substr(name, 0, pos);
-                    char *filter = php_can_substr(name, pos + 1, strlen(name) - (pos + 1));
-                    if (strcmp(filter, "int") == 0) {
-                        spprintf(&request->regexp, 0, "%s(?<%s>%s)", request->regexp, var, "-?[0-9]+");
-                        add_assoc_long(request->casts, var, IS_LONG);
-                    } else if (0 == strcmp(filter, "float")) {
-                        spprintf(&request->regexp, 0, "%s(?<%s>%s)", request->regexp, var, "-?[0-9.]+");
-                        add_assoc_long(request->casts, var, IS_DOUBLE);
-                    } else if (0 == strcmp(filter, "path")) {
-                        spprintf(&request->regexp, 0, "%s(?<%s>%s)", request->regexp, var, ".+?");
-                        add_assoc_long(request->casts, var, IS_PATH);
-                    } else if (0 == (pos = php_can_strpos(filter, "re:", 0))) {
-                        char *reg = php_can_substr(filter, pos + 3, strlen(filter) - (pos + 3));
-                        spprintf(&request->regexp, 0, "%s(?<%s>%s)", request->regexp, var, reg);
-                        efree(reg);
-                    }
-                    efree(filter);
-                    efree(var);
-                    
-                } else {
-                    spprintf(&request->regexp, 0, "%s(?<%s>[^/]+)", request->regexp, name);
+
+    if (options != NULL) {
+        zval **option;
+
+        // body handler receives the request body chunk by chunk as it arrives
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "body", sizeof("body"), (void **)&option)) {
+            if (!zend_is_callable(*option, 0, &func_name TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidCallbackException TSRMLS_CC,
+                    "Body handler '%s' is not a valid callback",
+                    func_name
+                );
+                efree(func_name);
+                return;
+            }
+            efree(func_name);
+            zval_add_ref(option);
+            request->body_handler = *option;
+        }
+
+        // progress handler is called every progress_interval bytes of the body
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "progress", sizeof("progress"), (void **)&option)) {
+            if (!zend_is_callable(*option, 0, &func_name TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidCallbackException TSRMLS_CC,
+                    "Progress handler '%s' is not a valid callback",
+                    func_name
+                );
+                efree(func_name);
+                return;
+            }
+            efree(func_name);
+            zval_add_ref(option);
+            request->progress_handler = *option;
+        }
+
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "progress_interval", sizeof("progress_interval"), (void **)&option)) {
+            zval tmp = **option;
+            zval_copy_ctor(&tmp);
+            convert_to_long(&tmp);
+            if (Z_LVAL(tmp) <= 0) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'progress_interval' must be greater than zero"
+                );
+                return;
+            }
+            request->progress_interval = Z_LVAL(tmp);
+        }
+
+        // storage handler chooses destination path of every uploaded file
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "storage", sizeof("storage"), (void **)&option)) {
+            if (!zend_is_callable(*option, 0, &func_name TSRMLS_CC)) {
+                php_can_throw_exception(
+                    ce_can_InvalidCallbackException TSRMLS_CC,
+                    "Storage handler '%s' is not a valid callback",
+                    func_name
+                );
+                efree(func_name);
+                return;
+            }
+            efree(func_name);
+            zval_add_ref(option);
+            request->storage_handler = *option;
+        }
+
+        // methods whose bodies are parsed into post, files and json
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "body_methods", sizeof("body_methods"), (void **)&option)) {
+            zval tmp = **option;
+            zval_copy_ctor(&tmp);
+            convert_to_long(&tmp);
+            if (Z_LVAL(tmp) & ~PHP_CAN_SERVER_ROUTE_METHOD_ALL) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'body_methods' must be a combination of Route::METHOD_* constants"
+                );
+                return;
+            }
+            request->body_methods = (int)Z_LVAL(tmp);
+        }
+
+        // JSON bodies larger than json_max_size are refused before the handler is called
+        route_option_long(options, "json_max_size", &request->json_max_size, 0);
+
+        // uploaded files up to this size are exposed as 'content' instead of 'tmp_name'
+        route_option_long(options, "upload_memory_limit", &request->upload_memory_limit, 0);
+
+        // upload limits are checked while the body is received, 0 disables the limit
+        route_option_long(options, "upload_max_filesize", &request->upload_max_filesize, 0);
+
+        // values of the multipart/form-data fields are limited as well, 0 disables the limit
+        route_option_long(options, "field_max_size", &request->field_max_size, 0);
+
+        route_option_long(options, "post_max_size", &request->post_max_size, 0);
+
+        // without the header callback of libevent (2.1) the server limit stays at the ini setting,
+        // routes with this option raise it and their bodies are checked once they are buffered
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "large_body", sizeof("large_body"), (void **)&option)) {
+            zval tmp = **option;
+            zval_copy_ctor(&tmp);
+            convert_to_boolean(&tmp);
+            request->large_body = Z_BVAL(tmp);
+        }
+
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "json_max_depth", sizeof("json_max_depth"), (void **)&option)) {
+            zval tmp = **option;
+            zval_copy_ctor(&tmp);
+            convert_to_long(&tmp);
+            if (Z_LVAL(tmp) <= 0) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'json_max_depth' must be greater than zero"
+                );
+                return;
+            }
+            request->json_max_depth = Z_LVAL(tmp);
+        }
+
+        // GET and HEAD responses are cached for cache_ttl seconds, 0 disables the cache
+        route_option_long(options, "cache_ttl", &request->cache_ttl, 0);
+
+        // expired response is served for cache_stale seconds more while it is refreshed after the reply
+        route_option_long(options, "cache_stale", &request->cache_stale, 0);
+
+        route_option_long(options, "cache_max_size", &request->cache_max_size, 0);
+
+        // handler responses get ETag of their body and conditional requests get 304
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "etag", sizeof("etag"), (void **)&option)) {
+            zval tmp = **option;
+            zval_copy_ctor(&tmp);
+            convert_to_boolean(&tmp);
+            request->etag = Z_BVAL(tmp);
+        }
+
+        // request headers whose values are part of the cache key
+        if (SUCCESS == zend_hash_find(Z_ARRVAL_P(options), "cache_vary", sizeof("cache_vary"), (void **)&option)) {
+            zval **name;
+            if (Z_TYPE_PP(option) != IS_ARRAY) {
+                php_can_throw_exception(
+                    ce_can_InvalidParametersException TSRMLS_CC,
+                    "Option 'cache_vary' must be an array of header names"
+                );
+                return;
+            }
+            PHP_CAN_FOREACH(*option, name) {
+                if (Z_TYPE_PP(name) != IS_STRING) {
+                    php_can_throw_exception(
+                        ce_can_InvalidParametersException TSRMLS_CC,
+                        "Option 'cache_vary' must be an array of header names"
+                    );
+                    return;
                 }
-                efree(name);
-                i = y;
             }
+            zval_add_ref(option);
+            request->cache_vary = *option;
         }
-        spprintf(&request->regexp, 0, "\1^%s$\1", request->regexp);
     }
     
-    request->route = estrndup(route, route_len);
+    route_compile(request, route, route_len TSRMLS_CC);
     
     if (methods & PHP_CAN_SERVER_ROUTE_METHOD_ALL) {
         request->methods = methods;
@@ -274,14 +502,83 @@ static PHP_METHOD(CanServerRoute, getHandler)
     struct php_can_server_route *route = (struct php_can_server_route*)
         zend_object_store_get_object(getThis() TSRMLS_CC);
     
+    if (route->handler == NULL) {
+        RETURN_NULL();
+    }
     RETURN_ZVAL(route->handler, 1, 0);
 }
 
+/**
+ * Create route serving files of the root directory without request handler,
+ * file name is taken from the path parameter of the route, e.g. '/assets/<file:path>'
+ */
+static PHP_METHOD(CanServerRoute, staticDir)
+{
+    char *uri, *root, resolved_root[MAXPATHLEN];
+    int uri_len, root_len;
+    zval *options = NULL, **item;
+
+    if (FAILURE == zend_parse_parameters_ex(ZEND_PARSE_PARAMS_QUIET, ZEND_NUM_ARGS() TSRMLS_CC,
+            "sp|a", &uri, &uri_len, &root, &root_len, &options) || root_len == 0) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(string $route, string $root[, array $options])",
+            class_name, space, get_active_function_name(TSRMLS_C)
+        );
+        return;
+    }
+
+    if (!VCWD_REALPATH(root, resolved_root) || php_check_open_basedir(resolved_root TSRMLS_CC)) {
+        const char *space, *class_name = get_active_class_name(&space TSRMLS_CC);
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "%s%s%s(): Cannot determine real path of $root value '%s'",
+            class_name, space, get_active_function_name(TSRMLS_C),
+            root
+        );
+        return;
+    }
+
+    object_init_ex(return_value, ce_can_server_route);
+    struct php_can_server_route *route = (struct php_can_server_route*)
+        zend_object_store_get_object(return_value TSRMLS_CC);
+
+    route_compile(route, uri, uri_len TSRMLS_CC);
+
+    // the first path parameter of the route is the requested file name
+    PHP_CAN_FOREACH(route->casts, item) {
+        if (Z_LVAL_PP(item) == IS_PATH && keytype == HASH_KEY_IS_STRING) {
+            route->static_param = estrdup(strkey);
+            break;
+        }
+    }
+    if (route->static_param == NULL) {
+        php_can_throw_exception(
+            ce_can_InvalidParametersException TSRMLS_CC,
+            "Route '%s' has no path parameter for the file name, e.g. <file:path>",
+            uri
+        );
+        zval_dtor(return_value);
+        RETURN_NULL();
+    }
+
+    route->static_root = estrdup(resolved_root);
+    route->methods = PHP_CAN_SERVER_ROUTE_METHOD_GET | PHP_CAN_SERVER_ROUTE_METHOD_HEAD;
+    route->body_methods = 0;
+
+    if (options != NULL) {
+        // files larger than chunksize are sent with chunked transfer encoding, 0 disables it
+        route_option_long(options, "chunksize", &route->static_chunksize, 0);
+    }
+}
+
 static zend_function_entry server_route_methods[] = {
     PHP_ME(CanServerRoute, __construct, NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRoute, getUri,      NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRoute, getMethod,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
     PHP_ME(CanServerRoute, getHandler,  NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC)
+    PHP_ME(CanServerRoute, staticDir,   NULL, ZEND_ACC_FINAL | ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
     {NULL, NULL, NULL}
 };
 
@@ -0,0 +1,288 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+#include "ext/standard/php_smart_str.h"
+
+#ifndef HAVE_TAILQFOREACH
+#include <sys/queue.h>
+#endif
+
+#include <event.h>
+#include <evhttp.h>
+
+/**
+ * Response cached by the route
+ */
+struct php_can_cached_response {
+    long status;
+    struct evkeyvalq headers;
+    struct evbuffer *body;
+    long len;
+    int key_len;
+    time_t stored;
+    time_t expires;
+    zend_bool refreshing;
+};
+
+static void cached_response_dtor(void *pDest)
+{
+    struct php_can_cached_response *response = *(struct php_can_cached_response **)pDest;
+
+    evhttp_clear_headers(&response->headers);
+    evbuffer_free(response->body);
+    efree(response);
+}
+
+/**
+ * Check if the route cache key varies on the request header
+ */
+static int cache_varies_on(struct php_can_server_route *route, const char *header)
+{
+    zval **name;
+
+    if (route->cache_vary) {
+        PHP_CAN_FOREACH(route->cache_vary, name) {
+            if (Z_TYPE_PP(name) == IS_STRING && strcasecmp(Z_STRVAL_PP(name), header) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Build cache key of the request from the method, URI, values of the headers
+ * the route varies on and accepted encoding, returns NULL if request is not cacheable.
+ * Responses to the requests with credentials are never shared unless the route varies on them
+ */
+char *php_can_cache_key(struct php_can_server_route *route, struct evhttp_request *req, int *key_len)
+{
+    smart_str key = {0};
+    zval **name;
+    int encoding;
+
+    if ((req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD)
+            || (evhttp_find_header(req->input_headers, "Authorization") != NULL
+                && !cache_varies_on(route, "Authorization"))
+            || (evhttp_find_header(req->input_headers, "Cookie") != NULL
+                && !cache_varies_on(route, "Cookie"))) {
+        return NULL;
+    }
+
+    smart_str_appends(&key, req->type == EVHTTP_REQ_GET ? "GET" : "HEAD");
+    smart_str_appendc(&key, '\0');
+    smart_str_appends(&key, evhttp_request_uri(req));
+
+    if (route->cache_vary) {
+        PHP_CAN_FOREACH(route->cache_vary, name) {
+            const char *value = evhttp_find_header(req->input_headers, Z_STRVAL_PP(name));
+            smart_str_appendc(&key, '\0');
+            if (value) {
+                smart_str_appends(&key, value);
+            }
+        }
+    }
+
+    // compressed responses are cached per encoding the client accepts
+    encoding = php_can_compress_accepted(req);
+    if (encoding != PHP_CAN_COMPRESS_NONE) {
+        smart_str_appendc(&key, '\0');
+        smart_str_appends(&key, php_can_compress_encoding_name(encoding));
+    }
+    smart_str_0(&key);
+
+    *key_len = key.len;
+    return key.c;
+}
+
+/**
+ * Send cached response for the key, an expired response is still sent within
+ * the stale period and stale is set for the first request which has to refresh it
+ * after the reply. Returns FAILURE if handler must be called
+ */
+int php_can_cache_send(struct php_can_server_route *route, struct php_can_server_request *request,
+        const char *key, int key_len, zend_bool *stale TSRMLS_DC)
+{
+    struct php_can_cached_response **cached, *response;
+    struct evkeyval *header;
+    struct evbuffer *buffer;
+    time_t now = time(NULL);
+    char age[32];
+
+    if (route->cache == NULL || FAILURE == zend_hash_find(route->cache, key, key_len + 1, (void **)&cached)) {
+        return FAILURE;
+    }
+    response = *cached;
+
+    if (now >= response->expires) {
+        if (now >= response->expires + route->cache_stale) {
+            route->cache_len -= response->len + response->key_len;
+            zend_hash_del(route->cache, key, key_len + 1);
+            return FAILURE;
+        }
+        if (!response->refreshing) {
+            // the first request after expiration gets the stale response as well,
+            // the response is refreshed once the reply is on its way
+            response->refreshing = 1;
+            *stale = 1;
+        }
+    }
+
+    TAILQ_FOREACH(header, &response->headers, next) {
+        evhttp_add_header(request->req->output_headers, header->key, header->value);
+    }
+
+    // conditional request for the cached response with ETag gets "Not Modified"
+    const char *etag = evhttp_find_header(&response->headers, "ETag");
+    const char *if_none_match = evhttp_find_header(request->req->input_headers, "If-None-Match");
+    int not_modified = etag != NULL && if_none_match != NULL && php_can_etag_matches(if_none_match, etag);
+    snprintf(age, sizeof(age), "%ld", (long)(now - response->stored));
+    evhttp_add_header(request->req->output_headers, "Age", age);
+
+    buffer = evbuffer_new();
+    if (not_modified) {
+        request->response_status = 304;
+        request->response_len = 0;
+    } else {
+#ifdef HAVE_EVBUFFER_ADD_BUFFER_REFERENCE
+        evbuffer_add_buffer_reference(buffer, response->body);
+#else
+        evbuffer_add(buffer, evbuffer_pullup(response->body, -1), response->len);
+#endif
+        request->response_status = response->status;
+        request->response_len = response->len;
+    }
+    php_can_http_date_header(request->req);
+    evhttp_send_reply(request->req, request->response_status, NULL, buffer);
+    request->status = PHP_CAN_SERVER_RESPONSE_STATUS_SENT;
+    evbuffer_free(buffer);
+
+    return SUCCESS;
+}
+
+static int cached_response_dead(void *pDest, void *argument TSRMLS_DC)
+{
+    struct php_can_cached_response *response = *(struct php_can_cached_response **)pDest;
+    struct php_can_server_route *route = (struct php_can_server_route *)argument;
+
+    if (time(NULL) >= response->expires + route->cache_stale) {
+        route->cache_len -= response->len + response->key_len;
+        return ZEND_HASH_APPLY_REMOVE;
+    }
+    return ZEND_HASH_APPLY_KEEP;
+}
+
+/**
+ * Check if response to the request may be cached, requests with credentials
+ * have no cache key unless the route varies on them
+ */
+static int cache_allowed(struct php_can_server_route *route, struct php_can_server_request *request)
+{
+    const char *cache_control;
+
+    if (request->status == PHP_CAN_SERVER_RESPONSE_STATUS_SENT || request->response_status != 200
+            || evhttp_find_header(request->req->output_headers, "Set-Cookie") != NULL) {
+        return 0;
+    }
+    cache_control = evhttp_find_header(request->req->output_headers, "Cache-Control");
+    if (cache_control != NULL && (strstr(cache_control, "no-store") != NULL
+            || strstr(cache_control, "no-cache") != NULL || strstr(cache_control, "private") != NULL)) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Store response to the request in the route cache before it is sent, response
+ * which cannot be cached just releases the refreshing cached response
+ */
+void php_can_cache_store(struct php_can_server_route *route, struct php_can_server_request *request,
+        const char *key, int key_len, struct evbuffer *body TSRMLS_DC)
+{
+    struct php_can_cached_response **cached, *response;
+    struct evkeyval *header;
+    long len = (long)EVBUFFER_LENGTH(body);
+    time_t now = time(NULL);
+
+    if (!cache_allowed(route, request) || len + key_len > route->cache_max_size) {
+        if (route->cache && SUCCESS == zend_hash_find(route->cache, key, key_len + 1, (void **)&cached)) {
+            (*cached)->refreshing = 0;
+        }
+        return;
+    }
+
+    if (route->cache == NULL) {
+        ALLOC_HASHTABLE(route->cache);
+        zend_hash_init(route->cache, 16, NULL, cached_response_dtor, 0);
+    }
+    if (SUCCESS == zend_hash_find(route->cache, key, key_len + 1, (void **)&cached)) {
+        route->cache_len -= (*cached)->len + (*cached)->key_len;
+        zend_hash_del(route->cache, key, key_len + 1);
+    }
+
+    // drop responses past their stale period first, then the oldest ones
+    if (route->cache_len + len + key_len > route->cache_max_size) {
+        zend_hash_apply_with_argument(route->cache, cached_response_dead, route TSRMLS_CC);
+    }
+    while (route->cache_len + len + key_len > route->cache_max_size && zend_hash_num_elements(route->cache) > 0) {
+        char *evict_key;
+        uint evict_key_len;
+        ulong index;
+        HashPosition pos;
+        zend_hash_internal_pointer_reset_ex(route->cache, &pos);
+        if (HASH_KEY_IS_STRING != zend_hash_get_current_key_ex(route->cache, &evict_key, &evict_key_len, &index, 0, &pos)
+                || FAILURE == zend_hash_get_current_data_ex(route->cache, (void **)&cached, &pos)) {
+            break;
+        }
+        route->cache_len -= (*cached)->len + (*cached)->key_len;
+        zend_hash_del(route->cache, evict_key, evict_key_len);
+    }
+
+    response = ecalloc(1, sizeof(*response));
+    response->status = request->response_status;
+    response->len = len;
+    response->key_len = key_len;
+    response->stored = now;
+    response->expires = now + route->cache_ttl;
+    TAILQ_INIT(&response->headers);
+    TAILQ_FOREACH(header, request->req->output_headers, next) {
+        // Date of the every response is its own, Content-Length is added on sending
+        if (strcasecmp(header->key, "Date") != 0 && strcasecmp(header->key, "Content-Length") != 0) {
+            evhttp_add_header(&response->headers, header->key, header->value);
+        }
+    }
+    response->body = evbuffer_new();
+    evbuffer_add(response->body, evbuffer_pullup(body, -1), len);
+
+    zend_hash_update(route->cache, key, key_len + 1, &response, sizeof(response), NULL);
+    route->cache_len += len + key_len;
+}
+
+/**
+ * Free responses cached by the route
+ */
+void php_can_cache_free(struct php_can_server_route *route)
+{
+    if (route->cache) {
+        zend_hash_destroy(route->cache);
+        FREE_HASHTABLE(route->cache);
+        route->cache = NULL;
+        route->cache_len = 0;
+    }
+}
@@ -0,0 +1,360 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:          |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+
+#ifdef HAVE_CAN_ZLIB
+#include <zlib.h>
+#endif
+
+/**
+ * Content codings by preference
+ */
+static const char *encodings[PHP_CAN_COMPRESS_ENCODINGS] = {"gzip", "deflate"};
+
+/**
+ * Response types compressed unless configured otherwise
+ */
+static const char *default_types[] = {
+    "text/html", "text/plain", "text/css", "text/csv", "text/xml", "text/javascript",
+    "application/javascript", "application/json", "application/xml", "application/xhtml+xml",
+    "application/rss+xml", "application/atom+xml", "image/svg+xml", NULL
+};
+
+/**
+ * Compression level, 0 when compression is disabled
+ */
+static long level = 0;
+static long min_size = PHP_CAN_SERVER_COMPRESSION_MIN_SIZE;
+static HashTable types;
+
+/**
+ * Totals of the compressed responses since the worker started
+ */
+static long stats_responses = 0;
+static long stats_bytes_in = 0;
+static long stats_bytes_out = 0;
+static double stats_cpu_time = 0.0;
+
+#ifdef HAVE_CAN_ZLIB
+/**
+ * Stream state of every encoding is allocated once per worker
+ * and reset before compressing the next response
+ */
+static z_stream streams[PHP_CAN_COMPRESS_ENCODINGS];
+static zend_bool streams_ready[PHP_CAN_COMPRESS_ENCODINGS];
+
+static void streams_end(void)
+{
+    int encoding;
+
+    for (encoding = 0; encoding < PHP_CAN_COMPRESS_ENCODINGS; encoding++) {
+        if (streams_ready[encoding]) {
+            deflateEnd(&streams[encoding]);
+            streams_ready[encoding] = 0;
+        }
+    }
+}
+
+static z_stream *stream_get(int encoding)
+{
+    z_stream *strm = &streams[encoding];
+
+    if (streams_ready[encoding]) {
+        deflateReset(strm);
+        return strm;
+    }
+    memset(strm, 0, sizeof(*strm));
+    // gzip wrapper is requested by adding 16 to the window bits, deflate is zlib format
+    if (Z_OK != deflateInit2(strm, (int)level, Z_DEFLATED,
+            encoding == PHP_CAN_COMPRESS_GZIP ? MAX_WBITS + 16 : MAX_WBITS, 8, Z_DEFAULT_STRATEGY)) {
+        return NULL;
+    }
+    streams_ready[encoding] = 1;
+    return strm;
+}
+
+/**
+ * Compress contents of the buffer chain by chain without making them contiguous
+ */
+static int compress_buffer(z_stream *strm, struct evbuffer *in, struct evbuffer *out)
+{
+    struct evbuffer_iovec *chains;
+    int n, i, ret = Z_OK, result = SUCCESS;
+
+    n = evbuffer_peek(in, -1, NULL, NULL, 0);
+    if (n <= 0) {
+        return FAILURE;
+    }
+    chains = safe_emalloc(n, sizeof(*chains), 0);
+    evbuffer_peek(in, -1, NULL, chains, n);
+
+    for (i = 0; i < n && result == SUCCESS; i++) {
+        int flush = i == n - 1 ? Z_FINISH : Z_NO_FLUSH;
+
+        strm->next_in = (Bytef *)chains[i].iov_base;
+        strm->avail_in = chains[i].iov_len;
+        do {
+            struct evbuffer_iovec space;
+            if (evbuffer_reserve_space(out, 16384, &space, 1) < 1) {
+                result = FAILURE;
+                break;
+            }
+            strm->next_out = (Bytef *)space.iov_base;
+            strm->avail_out = space.iov_len;
+            ret = deflate(strm, flush);
+            if (ret == Z_STREAM_ERROR) {
+                result = FAILURE;
+                break;
+            }
+            space.iov_len -= strm->avail_out;
+            evbuffer_commit_space(out, &space, 1);
+        } while (strm->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+    efree(chains);
+
+    return result;
+}
+
+static double cpu_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return 0.0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+#endif
+
+/**
+ * Check if the response type is compressed, types may be given
+ * as major type with wildcard: text/*
+ */
+static int type_compressible(const char *content_type)
+{
+    char type[128];
+    size_t len = 0;
+    char *slash;
+
+    if (content_type == NULL) {
+        // libevent sends text/html if handler has not set the type
+        content_type = "text/html";
+    }
+    while (*content_type == ' ') content_type++;
+    while (content_type[len] && content_type[len] != ';' && content_type[len] != ' ' && len < sizeof(type) - 2) {
+        type[len] = tolower((unsigned char)content_type[len]);
+        len++;
+    }
+    type[len] = '\0';
+
+    if (len == 0) {
+        return 0;
+    }
+    if (zend_hash_exists(&types, type, len + 1)) {
+        return 1;
+    }
+    if ((slash = strchr(type, '/')) != NULL) {
+        slash[1] = '*';
+        slash[2] = '\0';
+        return zend_hash_exists(&types, type, slash - type + 3);
+    }
+    return 0;
+}
+
+/**
+ * Configure compression of the handler responses, level of 0 disables it,
+ * types replace compressed response types if given.
+ * Returns FAILURE if the extension was built without zlib
+ */
+int php_can_compress_configure(long new_level, long new_min_size, zval *new_types TSRMLS_DC)
+{
+#ifdef HAVE_CAN_ZLIB
+    zval **type;
+
+    // streams are initialized with the level, so the next response gets new ones
+    streams_end();
+    level = new_level;
+    min_size = new_min_size;
+
+    if (new_types != NULL) {
+        zend_hash_clean(&types);
+        PHP_CAN_FOREACH(new_types, type) {
+            if (Z_TYPE_PP(type) == IS_STRING && Z_STRLEN_PP(type) > 0) {
+                char *lower = estrndup(Z_STRVAL_PP(type), Z_STRLEN_PP(type));
+                php_strtolower(lower, Z_STRLEN_PP(type));
+                zend_hash_add_empty_element(&types, lower, Z_STRLEN_PP(type) + 1);
+                efree(lower);
+            }
+        }
+    }
+    return SUCCESS;
+#else
+    return FAILURE;
+#endif
+}
+
+/**
+ * Best encoding the client accepts, PHP_CAN_COMPRESS_NONE if it accepts
+ * none or compression is disabled
+ */
+int php_can_compress_accepted(struct evhttp_request *req)
+{
+    const char *accept_encoding;
+    int encoding;
+
+    if (level == 0 || (accept_encoding = evhttp_find_header(req->input_headers, "Accept-Encoding")) == NULL) {
+        return PHP_CAN_COMPRESS_NONE;
+    }
+    for (encoding = 0; encoding < PHP_CAN_COMPRESS_ENCODINGS; encoding++) {
+        if (php_can_accepts_encoding(accept_encoding, encodings[encoding])) {
+            return encoding;
+        }
+    }
+    return PHP_CAN_COMPRESS_NONE;
+}
+
+const char *php_can_compress_encoding_name(int encoding)
+{
+    return encodings[encoding];
+}
+
+/**
+ * Decide if the response body of the given length is compressed,
+ * compressible responses vary by Accept-Encoding
+ */
+int php_can_compress_negotiate(struct php_can_server_request *request, size_t len)
+{
+    struct evkeyvalq *headers = request->req->output_headers;
+    const char *cache_control, *vary;
+
+    if (level == 0 || len == 0 || (long)len < min_size
+            || request->response_status < 200 || request->response_status >= 300
+            || request->response_status == 204 || request->response_status == 206
+            || evhttp_find_header(headers, "Content-Encoding") != NULL
+            || ((cache_control = evhttp_find_header(headers, "Cache-Control")) != NULL
+                && strstr(cache_control, "no-transform") != NULL)
+            || !type_compressible(evhttp_find_header(headers, "Content-Type"))) {
+        return PHP_CAN_COMPRESS_NONE;
+    }
+
+    vary = evhttp_find_header(headers, "Vary");
+    if (vary == NULL) {
+        evhttp_add_header(headers, "Vary", "Accept-Encoding");
+    } else if (strcmp(vary, "*") != 0) {
+        char *lower = zend_str_tolower_dup(vary, strlen(vary));
+        if (strstr(lower, "accept-encoding") == NULL) {
+            evhttp_add_header(headers, "Vary", "Accept-Encoding");
+        }
+        efree(lower);
+    }
+
+    return php_can_compress_accepted(request->req);
+}
+
+/**
+ * Add the encoding suffix to the ETag, so the representations never share a tag
+ */
+static void etag_add_encoding(struct evkeyvalq *headers, int encoding)
+{
+    const char *etag = evhttp_find_header(headers, "ETag"), *quote;
+    char *tagged;
+
+    if (etag == NULL || (quote = strrchr(etag, '"')) == NULL || quote == strchr(etag, '"')) {
+        return;
+    }
+    spprintf(&tagged, 0, "%.*s-%s%s", (int)(quote - etag), etag, encodings[encoding], quote);
+    evhttp_remove_header(headers, "ETag");
+    evhttp_add_header(headers, "ETag", tagged);
+    efree(tagged);
+}
+
+/**
+ * Replace the response body with its compressed form, body and ETag are
+ * left as is if compression fails or does not make the body any smaller
+ */
+int php_can_compress_response(struct php_can_server_request *request, struct evbuffer *buffer,
+        int encoding TSRMLS_DC)
+{
+#ifdef HAVE_CAN_ZLIB
+    struct evbuffer *out;
+    z_stream *strm;
+    size_t len = EVBUFFER_LENGTH(buffer);
+    double started = cpu_now();
+    int result = FAILURE;
+
+    if ((strm = stream_get(encoding)) == NULL) {
+        return FAILURE;
+    }
+
+    out = evbuffer_new();
+    if (compress_buffer(strm, buffer, out) == SUCCESS && EVBUFFER_LENGTH(out) < len) {
+        evbuffer_drain(buffer, len);
+        evbuffer_add_buffer(buffer, out);
+        evhttp_add_header(request->req->output_headers, "Content-Encoding", encodings[encoding]);
+        etag_add_encoding(request->req->output_headers, encoding);
+        request->response_len = EVBUFFER_LENGTH(buffer);
+
+        stats_responses++;
+        stats_bytes_in += len;
+        stats_bytes_out += EVBUFFER_LENGTH(buffer);
+        result = SUCCESS;
+    }
+    evbuffer_free(out);
+    stats_cpu_time += cpu_now() - started;
+
+    return result;
+#else
+    return FAILURE;
+#endif
+}
+
+/**
+ * Add compression totals to the array
+ */
+void php_can_compress_stats(zval *array TSRMLS_DC)
+{
+    add_assoc_long(array, "level", level);
+    add_assoc_long(array, "responses", stats_responses);
+    add_assoc_long(array, "bytes_in", stats_bytes_in);
+    add_assoc_long(array, "bytes_out", stats_bytes_out);
+    add_assoc_double(array, "cpu_time", stats_cpu_time);
+}
+
+void php_can_compress_init(TSRMLS_D)
+{
+    const char **type;
+
+    zend_hash_init(&types, 16, NULL, NULL, 0);
+    for (type = default_types; *type; type++) {
+        zend_hash_add_empty_element(&types, (char *)*type, strlen(*type) + 1);
+    }
+}
+
+void php_can_compress_destroy(TSRMLS_D)
+{
+#ifdef HAVE_CAN_ZLIB
+    streams_end();
+#endif
+    zend_hash_destroy(&types);
+    level = 0;
+    min_size = PHP_CAN_SERVER_COMPRESSION_MIN_SIZE;
+}
@@ -0,0 +1,613 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <event.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+/**
+ * Resolved files by the root and the requested file name, the table is kept
+ * in the order of the last use, so the least recently used entry is evicted
+ * once the cache is full
+ */
+static HashTable files;
+static long files_size = PHP_CAN_SERVER_FILE_CACHE_SIZE;
+static long files_ttl = PHP_CAN_SERVER_FILE_CACHE_TTL;
+
+static const char *variant_suffixes[PHP_CAN_FILE_ENCODINGS] = {".br", ".gz"};
+
+/**
+ * Contents of the small cached files kept in memory, least recently used
+ * contents are dropped once they exceed the budget, budget of 0 disables it
+ */
+static long contents_size = 0;
+static long contents_max_file = PHP_CAN_SERVER_MEMORY_CACHE_MAX_FILE;
+static long contents_len = 0;
+static struct php_can_file *lru_head = NULL, *lru_tail = NULL;
+
+#ifdef HAVE_SYS_INOTIFY_H
+/**
+ * Directories of the files kept in memory are watched, so their contents
+ * are dropped as soon as anything in the directory changes
+ */
+static int watch_fd = -1;
+static struct event watch_event;
+static HashTable watch_dirs;
+#endif
+
+static void file_free(struct php_can_file *file);
+
+static void lru_unlink(struct php_can_file *file)
+{
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        lru_tail = file->lru_prev;
+    }
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void lru_push(struct php_can_file *file)
+{
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = file;
+    }
+    lru_head = file;
+    if (lru_tail == NULL) {
+        lru_tail = file;
+    }
+}
+
+static void file_content_free(struct php_can_file *file)
+{
+    if (file->content) {
+        lru_unlink(file);
+        contents_len -= (long)file->st.st_size;
+        // replies still referring to the content keep their own references
+        evbuffer_free(file->content);
+        file->content = NULL;
+    }
+}
+
+static void file_variants_free(struct php_can_file *file)
+{
+    int i;
+
+    for (i = 0; i < PHP_CAN_FILE_ENCODINGS; i++) {
+        if (file->variants[i]) {
+            file_free(file->variants[i]);
+            file->variants[i] = NULL;
+        }
+    }
+    file->variants_checked = 0;
+}
+
+static void file_free(struct php_can_file *file)
+{
+    file_content_free(file);
+    file_variants_free(file);
+    if (file->fd != -1) {
+        close(file->fd);
+    }
+    if (file->mimetype) {
+        efree(file->mimetype);
+    }
+    efree(file->path);
+    efree(file);
+}
+
+static void file_dtor(void *pDest)
+{
+    file_free(*(struct php_can_file **)pDest);
+}
+
+/**
+ * Get realpath of the given path
+ */
+static char *get_realpath(char *path, int check_is_readable TSRMLS_DC)
+{
+    char resolved_path_buff[MAXPATHLEN];
+    if (VCWD_REALPATH(path, resolved_path_buff)) {
+        if (php_check_open_basedir(resolved_path_buff TSRMLS_CC)) {
+            return NULL;
+        }
+
+#ifdef R_OK
+        if (check_is_readable == 1 && VCWD_ACCESS(resolved_path_buff, R_OK)) {
+            return NULL;
+        }
+#endif
+        return estrdup(resolved_path_buff);
+    }
+    return NULL;
+}
+
+/**
+ * Generate ETag and Last-Modified of the file
+ */
+static void file_validators(struct php_can_file *file)
+{
+    snprintf(file->etag, sizeof(file->etag), "\"%x-%x-%x\"",
+        (int)file->st.st_ino, (int)file->st.st_mtime, (int)file->st.st_size);
+    php_can_http_date(file->st.st_mtime, file->last_modified);
+}
+
+/**
+ * Check if the resolved path is the root itself or lies within it
+ */
+static int path_within(const char *path, const char *root)
+{
+    size_t root_len = strlen(root);
+
+    if (strncmp(path, root, root_len) != 0) {
+        return 0;
+    }
+    // /var/www2 is not within /var/www
+    return path[root_len] == '\0' || path[root_len] == '/' || (root_len > 0 && root[root_len - 1] == '/');
+}
+
+/**
+ * Resolve the file within the root, open it and stat it,
+ * root is resolved as well unless it is known to be a real path already
+ */
+static struct php_can_file *file_resolve(char *root, int root_len, zend_bool root_resolved, char *filename TSRMLS_DC)
+{
+    struct php_can_file *file;
+
+    // try to determine real path of the given root
+    char *rootpath = NULL;
+    if (root_len > 0 && root_resolved) {
+        rootpath = estrndup(root, root_len);
+    } else if (root_len > 0) {
+        rootpath = get_realpath(root, 1 TSRMLS_CC);
+        if (rootpath == NULL) {
+            php_can_throw_exception(
+                ce_can_InvalidParametersException TSRMLS_CC,
+                "Cannot determine real path of the root '%s'", root
+            );
+            return NULL;
+        }
+    }
+
+    // try to determine real path of the root+file
+    char *tmppath = NULL;
+    spprintf(&tmppath, 0, "%s%s%s", rootpath ? rootpath : "", (rootpath && filename[0] != '/' ? "/" : ""), filename);
+
+    // resolve realpath of the requested file
+    char *filepath = get_realpath(tmppath, 0 TSRMLS_CC);
+    if (filepath == NULL) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 404, "Requested file '%s' does not exist", tmppath
+        );
+        efree(tmppath);
+        if (rootpath) {
+            efree(rootpath);
+        }
+        return NULL;
+    }
+    efree(tmppath);
+
+    // requested file exists, we check if file is within root path,
+    // otherwise we send 404 File Not Found to prevent giving informations
+    // about existence of this file on the server machine. This check prevents
+    // serving of the symlinks to outside of the root path as well.
+    if (rootpath && !path_within(filepath, rootpath)) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 404, "Requested file '%s' is not within root path '%s'", filepath, rootpath
+        );
+        efree(filepath);
+        efree(rootpath);
+        return NULL;
+    }
+
+    if (rootpath) {
+        efree(rootpath);
+    }
+
+#ifdef R_OK
+    // requested path exists and is within root path, check for read permissions
+    if (VCWD_ACCESS(filepath, R_OK)) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 403, "Requested file '%s' is not readable", filepath
+        );
+        efree(filepath);
+        return NULL;
+    }
+#endif
+
+    file = ecalloc(1, sizeof(*file));
+    file->path = filepath;
+    file->mimetype = NULL;
+
+    // open the requested path, file content is handed over to libevent by
+    // descriptor, so it never passes through PHP memory
+    file->fd = VCWD_OPEN(filepath, O_RDONLY);
+    if (file->fd == -1) {
+        php_can_throw_exception(
+            ce_can_RuntimeException TSRMLS_CC,
+            "Cannot read content of the file '%s'", filepath
+        );
+        file_free(file);
+        return NULL;
+    }
+
+    // get file stats
+    if (fstat(file->fd, &file->st) < 0) {
+        php_can_throw_exception(
+            ce_can_RuntimeException TSRMLS_CC,
+            "Cannot stat of the file '%s'", filepath
+        );
+        file_free(file);
+        return NULL;
+    }
+
+    // we do not serving directory listings, so if requested URI points to directory
+    // we send 403 Forbidden response to the client
+    if (S_ISDIR(file->st.st_mode)) {
+        php_can_throw_exception_code(
+            ce_can_HTTPError TSRMLS_CC, 403, "Requested path '%s' is a directory", filepath
+        );
+        file_free(file);
+        return NULL;
+    }
+
+    file_validators(file);
+
+    return file;
+}
+
+/**
+ * Check that cached file was not changed on disk since it was resolved,
+ * watched files are checked as well in case a change notification was lost
+ */
+static int file_valid(struct php_can_file *file, time_t now TSRMLS_DC)
+{
+    struct stat st;
+
+    // open_basedir may have been narrowed since the file was resolved
+    if (php_check_open_basedir_ex(file->path, 0 TSRMLS_CC)) {
+        return 0;
+    }
+    if (now - file->checked < files_ttl) {
+        return 1;
+    }
+    // precompressed siblings are looked up again after the TTL
+    file_variants_free(file);
+    if (VCWD_STAT(file->path, &st) != 0
+            || st.st_ino != file->st.st_ino
+            || st.st_dev != file->st.st_dev
+            || st.st_mtime != file->st.st_mtime
+            || st.st_size != file->st.st_size) {
+        return 0;
+    }
+    file->checked = now;
+    return 1;
+}
+
+/**
+ * Find the file within the root, hot files are served from the cache without
+ * path resolution and are revalidated with a single stat once per TTL, root_resolved
+ * tells that root is a real path already, HTTPError is thrown if file cannot be served
+ */
+struct php_can_file *php_can_file_open(char *root, int root_len, zend_bool root_resolved, 
+        char *filename, int filename_len TSRMLS_DC)
+{
+    struct php_can_file *file, **cached;
+    time_t now = time(NULL);
+    char *key;
+    int key_len;
+
+    if (files_size <= 0) {
+        file = file_resolve(root, root_len, root_resolved, filename TSRMLS_CC);
+        if (file) {
+            file->cached = 0;
+        }
+        return file;
+    }
+
+    // root and file name are separated by the null byte, neither of them may contain it
+    key_len = root_len + filename_len + 1;
+    key = emalloc(key_len + 1);
+    memcpy(key, root, root_len);
+    key[root_len] = '\0';
+    memcpy(key + root_len + 1, filename, filename_len);
+    key[key_len] = '\0';
+
+    if (SUCCESS == zend_hash_find(&files, key, key_len + 1, (void **)&cached)) {
+        if (file_valid(*cached, now TSRMLS_CC)) {
+            // move the entry to the tail without destroying the file
+            file = *cached;
+            files.pDestructor = NULL;
+            zend_hash_del(&files, key, key_len + 1);
+            files.pDestructor = file_dtor;
+            zend_hash_update(&files, key, key_len + 1, &file, sizeof(file), NULL);
+            efree(key);
+            return file;
+        }
+        zend_hash_del(&files, key, key_len + 1);
+    }
+
+    file = file_resolve(root, root_len, root_resolved, filename TSRMLS_CC);
+    if (file == NULL) {
+        efree(key);
+        return NULL;
+    }
+    file->cached = 1;
+    file->checked = now;
+
+    if (zend_hash_num_elements(&files) >= files_size) {
+        // evict the least recently used file
+        char *evict_key;
+        uint evict_key_len;
+        ulong index;
+        HashPosition pos;
+        zend_hash_internal_pointer_reset_ex(&files, &pos);
+        if (HASH_KEY_IS_STRING == zend_hash_get_current_key_ex(&files, &evict_key, &evict_key_len, &index, 0, &pos)) {
+            zend_hash_del(&files, evict_key, evict_key_len);
+        }
+    }
+    zend_hash_update(&files, key, key_len + 1, &file, sizeof(file), NULL);
+    efree(key);
+
+    return file;
+}
+
+/**
+ * Find precompressed sibling of the file for the encoding, e.g. app.js.br
+ * for app.js. Sibling must be a regular file, not a symlink, and must be not
+ * older than the file itself. Returns NULL if there is no such sibling, the
+ * sibling is owned by the file and must not be released
+ */
+struct php_can_file *php_can_file_variant(struct php_can_file *file, int encoding TSRMLS_DC)
+{
+    struct php_can_file *variant;
+    struct stat lst;
+    char *path = NULL;
+    int fd;
+
+    if (file->variants_checked & (1 << encoding)) {
+        return file->variants[encoding];
+    }
+    file->variants_checked |= 1 << encoding;
+
+    spprintf(&path, 0, "%s%s", file->path, variant_suffixes[encoding]);
+    if (VCWD_LSTAT(path, &lst) != 0 || !S_ISREG(lst.st_mode) || lst.st_mtime < file->st.st_mtime
+            || (fd = VCWD_OPEN(path, O_RDONLY)) == -1) {
+        efree(path);
+        return NULL;
+    }
+
+    variant = ecalloc(1, sizeof(*variant));
+    variant->path = path;
+    variant->fd = fd;
+    variant->cached = 1;
+    variant->checked = file->checked;
+    variant->watched = file->watched;
+
+    // sibling must be the file we have checked and not a replacement of it
+    if (fstat(fd, &variant->st) < 0 || variant->st.st_ino != lst.st_ino || variant->st.st_dev != lst.st_dev) {
+        file_free(variant);
+        return NULL;
+    }
+    file_validators(variant);
+
+    file->variants[encoding] = variant;
+    return variant;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int file_in_dir(void *pDest, void *argument TSRMLS_DC)
+{
+    struct php_can_file *file = *(struct php_can_file **)pDest;
+    const char *dir = (const char *)argument;
+    size_t dir_len = strlen(dir);
+
+    if (strncmp(file->path, dir, dir_len) == 0 && file->path[dir_len] == '/'
+            && strchr(file->path + dir_len + 1, '/') == NULL) {
+        return ZEND_HASH_APPLY_REMOVE;
+    }
+    return ZEND_HASH_APPLY_KEEP;
+}
+
+/**
+ * Something changed in the watched directory, drop all its cached files
+ */
+static void watch_cb(int fd, short event, void *arg)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char **dir;
+    TSRMLS_FETCH();
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        char *ptr = buf;
+        while (ptr < buf + len) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            if (SUCCESS == zend_hash_index_find(&watch_dirs, ev->wd, (void **)&dir)) {
+                zend_hash_apply_with_argument(&files, file_in_dir, *dir TSRMLS_CC);
+                if (ev->mask & IN_IGNORED) {
+                    zend_hash_index_del(&watch_dirs, ev->wd);
+                }
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+static void watch_dir_dtor(void *pDest)
+{
+    efree(*(char **)pDest);
+}
+
+/**
+ * Watch directory of the file, returns SUCCESS if it is watched
+ */
+static int watch_file(struct php_can_file *file)
+{
+    char *dir, *slash;
+    int wd;
+
+    if (watch_fd == -1) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd == -1) {
+            return FAILURE;
+        }
+        event_set(&watch_event, watch_fd, EV_READ | EV_PERSIST, watch_cb, NULL);
+        event_add(&watch_event, NULL);
+    }
+
+    slash = strrchr(file->path, '/');
+    if (slash == NULL) {
+        return FAILURE;
+    }
+    dir = estrndup(file->path, slash - file->path);
+    wd = inotify_add_watch(watch_fd, slash == file->path ? "/" : dir,
+        IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd == -1) {
+        efree(dir);
+        return FAILURE;
+    }
+    // the same directory is always watched with the same descriptor
+    zend_hash_index_update(&watch_dirs, wd, &dir, sizeof(char *), NULL);
+    return SUCCESS;
+}
+#endif
+
+/**
+ * Get content of the cached file kept in memory, content is read on first
+ * call and kept within the memory budget. Returns NULL if the file is
+ * not cached, too large or memory cache is disabled
+ */
+struct evbuffer *php_can_file_content(struct php_can_file *file TSRMLS_DC)
+{
+#ifdef HAVE_EVBUFFER_ADD_BUFFER_REFERENCE
+    struct evbuffer_iovec vec;
+    long len = (long)file->st.st_size, done = 0;
+
+    if (file->content) {
+        lru_unlink(file);
+        lru_push(file);
+        return file->content;
+    }
+    if (!file->cached || len == 0 || len > contents_max_file || len > contents_size) {
+        return NULL;
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+    // watch before reading, so any change after the read drops the content
+    if (!file->watched && watch_file(file) == SUCCESS) {
+        file->watched = 1;
+    }
+#endif
+
+    file->content = evbuffer_new();
+    if (evbuffer_reserve_space(file->content, len, &vec, 1) < 1) {
+        evbuffer_free(file->content);
+        file->content = NULL;
+        return NULL;
+    }
+    while (done < len) {
+        ssize_t n = pread(file->fd, (char *)vec.iov_base + done, len - done, done);
+        if (n <= 0) {
+            evbuffer_free(file->content);
+            file->content = NULL;
+            return NULL;
+        }
+        done += n;
+    }
+    vec.iov_len = len;
+    evbuffer_commit_space(file->content, &vec, 1);
+
+    while (contents_len + len > contents_size && lru_tail) {
+        file_content_free(lru_tail);
+    }
+    contents_len += len;
+    lru_push(file);
+
+    return file->content;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * Release the file returned by php_can_file_open()
+ */
+void php_can_file_release(struct php_can_file *file)
+{
+    if (!file->cached) {
+        file_free(file);
+    }
+}
+
+/**
+ * Configure file cache, the size of 0 disables the cache
+ */
+void php_can_file_cache_configure(long size, long ttl TSRMLS_DC)
+{
+    files_size = size;
+    files_ttl = ttl;
+    zend_hash_clean(&files);
+}
+
+/**
+ * Configure memory cache of the file contents, the size of 0 disables it
+ */
+void php_can_file_memory_configure(long size, long max_file TSRMLS_DC)
+{
+    while (lru_tail) {
+        file_content_free(lru_tail);
+    }
+    contents_size = size;
+    contents_max_file = max_file;
+}
+
+void php_can_file_cache_init(TSRMLS_D)
+{
+    zend_hash_init(&files, 64, NULL, file_dtor, 0);
+#ifdef HAVE_SYS_INOTIFY_H
+    zend_hash_init(&watch_dirs, 8, NULL, watch_dir_dtor, 0);
+#endif
+}
+
+void php_can_file_cache_destroy(TSRMLS_D)
+{
+    zend_hash_destroy(&files);
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watch_fd != -1) {
+        event_del(&watch_event);
+        close(watch_fd);
+        watch_fd = -1;
+    }
+    zend_hash_destroy(&watch_dirs);
+#endif
+}
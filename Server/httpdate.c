@@ -0,0 +1,217 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#include <event.h>
+#include <evhttp.h>
+
+static const char *weekdays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/**
+ * Strings for the current second, regenerated once the second changes
+ */
+static time_t now_http_sec = -1;
+static char now_http[PHP_CAN_HTTP_DATE_LEN + 1];
+static time_t now_log_sec = -1;
+static char now_log_date[sizeof("YYYY-mm-dd")];
+static char now_log_time[sizeof("HH:ii:ss")];
+
+/**
+ * Number of days since the epoch of the given civil date
+ */
+static long days_from_civil(long y, long m, long d)
+{
+    long era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**
+ * Format timestamp as IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT,
+ * buffer must have room for PHP_CAN_HTTP_DATE_LEN + 1 bytes
+ */
+size_t php_can_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    return snprintf(buf, PHP_CAN_HTTP_DATE_LEN + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+        weekdays[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+        tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+static int parse_digits(const char **p, int min, int max, long *value)
+{
+    int n = 0;
+
+    *value = 0;
+    while (n < max && **p >= '0' && **p <= '9') {
+        *value = *value * 10 + (**p - '0');
+        (*p)++;
+        n++;
+    }
+    return n >= min ? SUCCESS : FAILURE;
+}
+
+static int parse_month(const char **p, long *month)
+{
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        if (strncasecmp(*p, months[i], 3) == 0) {
+            *month = i + 1;
+            *p += 3;
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+static int parse_time(const char **p, long *h, long *i, long *s)
+{
+    if (parse_digits(p, 2, 2, h) == FAILURE || *(*p)++ != ':'
+            || parse_digits(p, 2, 2, i) == FAILURE || *(*p)++ != ':'
+            || parse_digits(p, 2, 2, s) == FAILURE) {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Parse HTTP date in IMF-fixdate, obsolete RFC 850 or asctime format,
+ * returns -1 if the date cannot be parsed
+ */
+time_t php_can_http_date_parse(const char *str)
+{
+    const char *p = str;
+    long year, month, day, h, i, s;
+
+    // skip day name
+    while (*p && *p != ',' && *p != ' ') p++;
+
+    if (*p == ',') {
+        // Sun, 06 Nov 1994 08:49:37 GMT or Sunday, 06-Nov-94 08:49:37 GMT
+        p++;
+        while (*p == ' ') p++;
+        if (parse_digits(&p, 1, 2, &day) == FAILURE || (*p != ' ' && *p != '-')) {
+            return -1;
+        }
+        p++;
+        if (parse_month(&p, &month) == FAILURE || (*p != ' ' && *p != '-')) {
+            return -1;
+        }
+        p++;
+        const char *y = p;
+        if (parse_digits(&p, 2, 4, &year) == FAILURE) {
+            return -1;
+        }
+        if (p - y == 2) {
+            // two digits year
+            year += year < 70 ? 2000 : 1900;
+        }
+        if (*p++ != ' ' || parse_time(&p, &h, &i, &s) == FAILURE || strncmp(p, " GMT", 4) != 0) {
+            return -1;
+        }
+    } else if (*p == ' ') {
+        // Sun Nov  6 08:49:37 1994
+        p++;
+        if (parse_month(&p, &month) == FAILURE || *p++ != ' ') {
+            return -1;
+        }
+        while (*p == ' ') p++;
+        if (parse_digits(&p, 1, 2, &day) == FAILURE || *p++ != ' '
+                || parse_time(&p, &h, &i, &s) == FAILURE || *p++ != ' '
+                || parse_digits(&p, 4, 4, &year) == FAILURE) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    if (day < 1 || day > 31 || h > 23 || i > 59 || s > 60) {
+        return -1;
+    }
+
+    return (time_t)(days_from_civil(year, month, day) * 86400 + h * 3600 + i * 60 + s);
+}
+
+/**
+ * Current time as IMF-fixdate, the string is formatted once per second
+ */
+const char *php_can_http_now(void)
+{
+    time_t now = time(NULL);
+
+    if (now != now_http_sec) {
+        php_can_http_date(now, now_http);
+        now_http_sec = now;
+    }
+    return now_http;
+}
+
+/**
+ * Add Date header to the response about to be sent unless the handler has set it,
+ * libevent would format it for every response otherwise
+ */
+void php_can_http_date_header(struct evhttp_request *req)
+{
+    if (evhttp_find_header(req->output_headers, "Date") == NULL) {
+        evhttp_add_header(req->output_headers, "Date", php_can_http_now());
+    }
+}
+
+static void log_now(time_t now TSRMLS_DC)
+{
+    struct tm tm;
+
+    if (now != now_log_sec) {
+        localtime_r(&now, &tm);
+        snprintf(now_log_date, sizeof(now_log_date), "%04d-%02d-%02d",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        snprintf(now_log_time, sizeof(now_log_time), "%02d:%02d:%02d",
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+        now_log_sec = now;
+    }
+}
+
+/**
+ * Local date of the log entry, the string is formatted once per second
+ */
+const char *php_can_log_date(time_t now TSRMLS_DC)
+{
+    log_now(now TSRMLS_CC);
+    return now_log_date;
+}
+
+/**
+ * Local time of the log entry, the string is formatted once per second
+ */
+const char *php_can_log_time(time_t now TSRMLS_DC)
+{
+    log_now(now TSRMLS_CC);
+    return now_log_time;
+}
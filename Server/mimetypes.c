@@ -0,0 +1,229 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+/**
+ * Built-in mime types, sorted by extension, text types are declared as UTF-8
+ * just as finfo declared the charset it detected
+ */
+static const struct {
+    const char *ext;
+    const char *type;
+} builtin_types[] = {
+    {"7z",    "application/x-7z-compressed"},
+    {"atom",  "application/atom+xml"},
+    {"avi",   "video/x-msvideo"},
+    {"avif",  "image/avif"},
+    {"bin",   "application/octet-stream"},
+    {"bmp",   "image/bmp"},
+    {"bz2",   "application/x-bzip2"},
+    {"css",   "text/css; charset=utf-8"},
+    {"csv",   "text/csv; charset=utf-8"},
+    {"doc",   "application/msword"},
+    {"docx",  "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"eot",   "application/vnd.ms-fontobject"},
+    {"flac",  "audio/flac"},
+    {"gif",   "image/gif"},
+    {"gz",    "application/gzip"},
+    {"htm",   "text/html; charset=utf-8"},
+    {"html",  "text/html; charset=utf-8"},
+    {"ico",   "image/x-icon"},
+    {"ics",   "text/calendar; charset=utf-8"},
+    {"jar",   "application/java-archive"},
+    {"jpeg",  "image/jpeg"},
+    {"jpg",   "image/jpeg"},
+    {"js",    "application/javascript; charset=utf-8"},
+    {"json",  "application/json"},
+    {"m4a",   "audio/mp4"},
+    {"manifest", "text/cache-manifest; charset=utf-8"},
+    {"map",   "application/json"},
+    {"md",    "text/markdown; charset=utf-8"},
+    {"mjs",   "application/javascript; charset=utf-8"},
+    {"mov",   "video/quicktime"},
+    {"mp3",   "audio/mpeg"},
+    {"mp4",   "video/mp4"},
+    {"mpeg",  "video/mpeg"},
+    {"mpg",   "video/mpeg"},
+    {"oga",   "audio/ogg"},
+    {"ogg",   "audio/ogg"},
+    {"ogv",   "video/ogg"},
+    {"otf",   "font/otf"},
+    {"pdf",   "application/pdf"},
+    {"png",   "image/png"},
+    {"ppt",   "application/vnd.ms-powerpoint"},
+    {"pptx",  "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"rar",   "application/vnd.rar"},
+    {"rss",   "application/rss+xml"},
+    {"rtf",   "application/rtf"},
+    {"svg",   "image/svg+xml"},
+    {"svgz",  "image/svg+xml"},
+    {"swf",   "application/x-shockwave-flash"},
+    {"tar",   "application/x-tar"},
+    {"tif",   "image/tiff"},
+    {"tiff",  "image/tiff"},
+    {"ttf",   "font/ttf"},
+    {"txt",   "text/plain; charset=utf-8"},
+    {"wasm",  "application/wasm"},
+    {"wav",   "audio/wav"},
+    {"weba",  "audio/webm"},
+    {"webm",  "video/webm"},
+    {"webmanifest", "application/manifest+json"},
+    {"webp",  "image/webp"},
+    {"woff",  "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xhtml", "application/xhtml+xml"},
+    {"xls",   "application/vnd.ms-excel"},
+    {"xlsx",  "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"xml",   "application/xml"},
+    {"zip",   "application/zip"},
+};
+
+/**
+ * Mime types loaded with Server::loadMimeTypes(), extension => type,
+ * looked up before the built-in types
+ */
+static HashTable mimetypes;
+
+static void mimetype_dtor(void *pDest)
+{
+    efree(*(char **)pDest);
+}
+
+/**
+ * Find mime type of the file by its extension, returns NULL if extension is unknown
+ */
+const char *php_can_mimetype(const char *path, size_t len)
+{
+    const char *ext = NULL, **type;
+    char lower[16];
+    size_t i, ext_len;
+    int lo, hi;
+
+    for (i = len; i > 0; i--) {
+        if (path[i - 1] == '.') {
+            ext = path + i;
+            break;
+        }
+        if (path[i - 1] == '/') {
+            break;
+        }
+    }
+    if (ext == NULL) {
+        return NULL;
+    }
+
+    ext_len = path + len - ext;
+    if (ext_len == 0 || ext_len >= sizeof(lower)) {
+        return NULL;
+    }
+    for (i = 0; i < ext_len; i++) {
+        lower[i] = tolower((unsigned char)ext[i]);
+    }
+    lower[ext_len] = '\0';
+
+    if (zend_hash_num_elements(&mimetypes) > 0
+            && SUCCESS == zend_hash_find(&mimetypes, lower, ext_len + 1, (void **)&type)) {
+        return *type;
+    }
+
+    lo = 0;
+    hi = sizeof(builtin_types) / sizeof(builtin_types[0]) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(lower, builtin_types[mid].ext);
+        if (cmp == 0) {
+            return builtin_types[mid].type;
+        }
+        if (cmp < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Load mime types from the file in mime.types format, every line is
+ * a type followed by its extensions, lines beginning with # are comments.
+ * Returns number of loaded extensions or FAILURE if file cannot be read
+ */
+int php_can_mimetypes_load(const char *filename TSRMLS_DC)
+{
+    php_stream *stream;
+    char *line;
+    size_t line_len;
+    int count = 0;
+
+    // caller reports the failure, so the stream does not warn about it
+    stream = php_stream_open_wrapper((char *)filename, "rb", 0, NULL);
+    if (stream == NULL) {
+        return FAILURE;
+    }
+
+    while ((line = php_stream_get_line(stream, NULL, 0, &line_len)) != NULL) {
+        char *p = line, *end = line + line_len, *type, *type_end;
+
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p == end || *p == '#') {
+            efree(line);
+            continue;
+        }
+
+        type = p;
+        while (p < end && !isspace((unsigned char)*p)) p++;
+        type_end = p;
+
+        while (p < end) {
+            char *ext;
+            size_t ext_len, i;
+
+            while (p < end && isspace((unsigned char)*p)) p++;
+            if (p == end || *p == '#') {
+                break;
+            }
+            ext = p;
+            while (p < end && !isspace((unsigned char)*p)) p++;
+            ext_len = p - ext;
+            for (i = 0; i < ext_len; i++) {
+                ext[i] = tolower((unsigned char)ext[i]);
+            }
+
+            char *value = estrndup(type, type_end - type);
+            char *key = estrndup(ext, ext_len);
+            zend_hash_update(&mimetypes, key, ext_len + 1, &value, sizeof(char *), NULL);
+            efree(key);
+            count++;
+        }
+        efree(line);
+    }
+    php_stream_close(stream);
+
+    return count;
+}
+
+void php_can_mimetypes_init(TSRMLS_D)
+{
+    zend_hash_init(&mimetypes, 64, NULL, mimetype_dtor, 0);
+}
+
+void php_can_mimetypes_destroy(TSRMLS_D)
+{
+    zend_hash_destroy(&mimetypes);
+}
@@ -18,7 +18,11 @@
 
 #include "php.h"
 #include "Exception.h"
+#include "Server.h"
+#include "ext/standard/php_smart_str.h"
 #include <event.h>
+#include <errno.h>
+#include <fcntl.h>
 
 /* The longest anonymous name */
 #define MAX_SIZE_ANONNAME 33
@@ -27,14 +31,12 @@
 #include "ext/mbstring/mbstring.h"
 #endif
 
-static int unlink_filename(zval **item TSRMLS_DC)
+static void temp_file_dtor(void *pDest)
 {
-    if (Z_TYPE_PP(item) == IS_STRING
-        && strstr(Z_STRVAL_PP(item), "/phpcan") != NULL) {
-        VCWD_UNLINK(Z_STRVAL_PP(item));
-    }
-    zval_ptr_dtor(item);
-    return 0;
+    char *path = *(char **)pDest;
+
+    unlink(path);
+    efree(path);
 }
 
 static char * getword(char **line, char stop)
@@ -167,249 +169,821 @@ look_for_quote:
     return res;
 }
 
-static const char* my_memmem( const char * s1, size_t l1, const char * s2, size_t l2 )
+#define MULTIPART_PREAMBLE      0
+#define MULTIPART_BOUNDARY      1
+#define MULTIPART_BOUNDARY_DASH 2
+#define MULTIPART_BOUNDARY_LWS  3
+#define MULTIPART_HEADERS       4
+#define MULTIPART_DATA          5
+#define MULTIPART_EPILOGUE      6
+#define MULTIPART_ERROR         7
+
+#define MULTIPART_SINK_SKIP     0
+#define MULTIPART_SINK_FIELD    1
+#define MULTIPART_SINK_FILE     2
+
+/* The longest part headers block we are going to keep in memory */
+#define MAX_SIZE_PARTHEADERS 16384
+
+struct php_can_multipart {
+    int state;
+    /* delimiter is "\r\n--boundary", body is parsed as if it starts with CRLF */
+    char *delim;
+    size_t delim_len;
+    /* Horspool shift for every byte which may end the search window */
+    size_t skip[256];
+    /* tail of the previous chunk which may be the beginning of the delimiter */
+    char *held;
+    size_t held_len;
+    smart_str headers;
+    size_t line_start;
+    int sink;
+    char *name;
+    char *filename;
+    char *content_type;
+    smart_str value;
+    int fd;
+    /* temporary file, next to the destination if it was chosen by the storage handler */
+    char *temp_filename;
+    char *dest_filename;
+    zend_bool stored;
+    size_t file_size;
+    zval *storage;
+    size_t memory_limit;
+    size_t max_filesize;
+    size_t max_fieldsize;
+    int upload_cnt;
+    /* HTTP status of the parsing error, 0 if body is fine so far */
+    long status;
+    size_t anonindex;
+    zval *post;
+    zval *files;
+    /* temporary files of the uploads, removed when the request is destroyed */
+    HashTable **temp_files;
+};
+
+/**
+ * Extract boundary from the Content-Type header, returns 0 on success,
+ * -1 if boundary is missing and -2 if quoted boundary is not terminated
+ */
+static int multipart_boundary(const char *content_type, char **boundary, size_t *boundary_len)
 {
-    if( !l2 ) return s1;
-    while( l1 >= l2 )
-    {
-        l1--;
-        if( !memcmp( s1, s2, l2 ) )
-            return s1;
-        s1++;
+    const char *start = strstr(content_type, "boundary"), *end;
+
+    if (!start || !(start = strchr(start, '='))) {
+        return -1;
     }
-    return NULL;
+    start++;
+
+    if (start[0] == '"') {
+        start++;
+        end = strchr(start, '"');
+        if (!end) {
+            return -2;
+        }
+    } else {
+        // search for the end of the boundary
+        end = start + strcspn(start, ",; \t");
+    }
+
+    if (end == start) {
+        return -1;
+    }
+    *boundary_len = end - start;
+    *boundary = estrndup(start, *boundary_len);
+    return 0;
 }
 
-static int unlink_uploaded_files(char **filename TSRMLS_DC)
+/**
+ * Find the delimiter in the data using Horspool search, the window is moved by
+ * the shift of its last byte so binary data is mostly skipped delimiter length at once
+ */
+static const char *multipart_find(struct php_can_multipart *mp, const char *data, size_t len)
 {
-    VCWD_UNLINK(*filename);
-    return 0;
+    const unsigned char *p = (const unsigned char *)data, *end;
+    size_t last = mp->delim_len - 1;
+    unsigned char c, tail = (unsigned char)mp->delim[last];
+
+    if (len < mp->delim_len) {
+        return NULL;
+    }
+
+    end = p + len - mp->delim_len;
+    while (p <= end) {
+        c = p[last];
+        if (c == tail && !memcmp(p, mp->delim, last)) {
+            return (const char *)p;
+        }
+        p += mp->skip[c];
+    }
+    return NULL;
 }
 
-void  php_can_parse_multipart(const char* content_type, struct evbuffer* buffer, zval* post, zval** files TSRMLS_DC)
+/**
+ * Remove temporary file of the part being received
+ */
+static void multipart_discard_file(struct php_can_multipart *mp TSRMLS_DC)
 {
-    char *boundary      = NULL,
-         *boundary_end  = NULL,
-         *boundary_val  = NULL,
-         *temp_filename = NULL,
-         *max_uploads   = INI_STR("max_file_uploads");
+    if (mp->fd != -1) {
+        close(mp->fd);
+        mp->fd = -1;
+    }
+    if (mp->temp_filename) {
+        VCWD_UNLINK(mp->temp_filename);
+        efree(mp->temp_filename);
+        mp->temp_filename = NULL;
+    }
+    if (mp->dest_filename) {
+        efree(mp->dest_filename);
+        mp->dest_filename = NULL;
+    }
+}
 
-    int max_file_size = 0,
-        skip_upload   = 0,
-        upload_cnt    = 0,
-        fd            = -1;
+/**
+ * Release state of the current part
+ */
+static void multipart_reset_part(struct php_can_multipart *mp TSRMLS_DC)
+{
+    multipart_discard_file(mp TSRMLS_CC);
+    if (mp->name) {
+        efree(mp->name);
+        mp->name = NULL;
+    }
+    if (mp->filename) {
+        efree(mp->filename);
+        mp->filename = NULL;
+    }
+    if (mp->content_type) {
+        efree(mp->content_type);
+        mp->content_type = NULL;
+    }
+    smart_str_free(&mp->value);
+    mp->stored = 0;
+    mp->file_size = 0;
+    mp->sink = MULTIPART_SINK_SKIP;
+}
 
-    size_t boundary_len     = 0,
-           boundary_val_len = 0,
-           anonindex        = 0,
-           is_anonymous     = 0;
+/**
+ * Write whole data to the temporary file of the part
+ */
+static int multipart_write(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC)
+{
+    while (len > 0) {
+        ssize_t wlen = write(mp->fd, data, len);
+        if (wlen == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "File upload error - unable to write to a temporary file");
+            multipart_discard_file(mp TSRMLS_CC);
+            mp->sink = MULTIPART_SINK_SKIP;
+            return FAILURE;
+        }
+        data += wlen;
+        len -= wlen;
+    }
+    return SUCCESS;
+}
 
-    const char * in     = EVBUFFER_DATA( buffer );
-    size_t       inlen  = EVBUFFER_LENGTH( buffer );
+/**
+ * Create temporary file next to the destination, so that it can be renamed
+ * into place, returns descriptor of the file or -1
+ */
+static int multipart_dest_open(const char *dest_filename, char **temp_filename)
+{
+    const char *slash = strrchr(dest_filename, '/');
+    mode_t mask;
+    int fd;
 
-    if (max_uploads && *max_uploads) {
-        upload_cnt = atoi(max_uploads);
+    if (slash) {
+        spprintf(temp_filename, 0, "%.*s/.phpcanXXXXXX", (int)(slash - dest_filename), dest_filename);
+    } else {
+        *temp_filename = estrdup(".phpcanXXXXXX");
+    }
+    fd = mkstemp(*temp_filename);
+    if (fd == -1) {
+        efree(*temp_filename);
+        *temp_filename = NULL;
+        return -1;
     }
+    // mkstemp creates the file readable by the owner only
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    return fd;
+}
 
-    // Get the boundary
-    boundary = strstr(content_type, "boundary");
-    if (!boundary || !(boundary = strchr(boundary, '='))) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Missing boundary in multipart/form-data POST data");
+/**
+ * Pass part data to the part sink, files are kept in memory while they are
+ * smaller than the memory limit and written to disk as they arrive otherwise
+ */
+static void multipart_emit(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC)
+{
+    if (len == 0) {
         return;
     }
 
-    boundary++;
-    boundary_len = strlen(boundary);
-
-    if (boundary[0] == '"') {
-        boundary++;
-        boundary_end = strchr(boundary, '"');
-        if (!boundary_end) {
-            php_can_throw_exception(
-                ce_can_LogicException TSRMLS_CC,
-                "Invalid boundary in multipart/form-data POST data"
-            );
+    if (mp->sink == MULTIPART_SINK_FIELD) {
+        if (mp->max_fieldsize > 0 && mp->value.len + len > mp->max_fieldsize) {
+            // field value is not going to be accepted anyway
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "Field '%s' exceeds the maximum allowed size of %lu bytes",
+                mp->name, (unsigned long)mp->max_fieldsize);
+            smart_str_free(&mp->value);
+            mp->sink = MULTIPART_SINK_SKIP;
+            mp->status = 413;
             return;
         }
-    } else {
-        // search for the end of the boundary
-        boundary_end = strchr(boundary, ',');
-    }
-    if (boundary_end) {
-        boundary_end[0] = '\0';
-        boundary_len = boundary_end - boundary;
+        smart_str_appendl(&mp->value, data, len);
+    } else if (mp->sink == MULTIPART_SINK_FILE) {
+        mp->file_size += len;
+        if (mp->max_filesize > 0 && mp->file_size > mp->max_filesize) {
+            // the rest of the file is not going to be accepted anyway
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "File upload error - file exceeds the maximum allowed size of %lu bytes", 
+                (unsigned long)mp->max_filesize);
+            multipart_discard_file(mp TSRMLS_CC);
+            smart_str_free(&mp->value);
+            mp->sink = MULTIPART_SINK_SKIP;
+            mp->status = 413;
+            return;
+        }
+        if (mp->fd == -1 && mp->dest_filename) {
+            // file goes to the directory chosen by the storage handler, it replaces
+            // the destination only when the whole part is received
+            if ((mp->fd = multipart_dest_open(mp->dest_filename, &mp->temp_filename)) == -1) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                    "File upload error - unable to create file in the directory of '%s'", mp->dest_filename);
+                mp->sink = MULTIPART_SINK_SKIP;
+                return;
+            }
+            mp->stored = 1;
+        } else if (mp->fd == -1) {
+            if (mp->file_size <= mp->memory_limit) {
+                smart_str_appendl(&mp->value, data, len);
+                return;
+            }
+            mp->fd = php_open_temporary_fd_ex(PG(upload_tmp_dir), "phpcan", &mp->temp_filename, 1 TSRMLS_CC);
+            if (mp->fd == -1) { // create temporary file failed
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                    "File upload error - unable to create a temporary file");
+                mp->sink = MULTIPART_SINK_SKIP;
+                return;
+            }
+            // file outgrew the memory limit, move what we have got so far to disk
+            if (mp->value.len > 0) {
+                if (multipart_write(mp, mp->value.c, mp->value.len TSRMLS_CC) == FAILURE) {
+                    return;
+                }
+                smart_str_free(&mp->value);
+            }
+        }
+        multipart_write(mp, data, len TSRMLS_CC);
     }
+}
 
-    // set boundary value
-    spprintf(&boundary_val, 0, "--%s", boundary);
-    boundary_val_len = strlen(boundary_val);
+/**
+ * Ask storage handler of the route where the file goes, the handler gets
+ * the part description and returns destination path or null for a temporary file
+ */
+static void multipart_storage(struct php_can_multipart *mp TSRMLS_DC)
+{
+    zval retval, *part, *args[1];
+    int result = SUCCESS;
+
+    MAKE_STD_ZVAL(part);
+    array_init(part);
+    add_assoc_string(part, "name", mp->name ? mp->name : "", 1);
+    add_assoc_string(part, "filename", mp->filename, 1);
+    if (mp->content_type) {
+        add_assoc_string(part, "type", mp->content_type, 1);
+    }
+    args[0] = part;
+
+    if (call_user_function(EG(function_table), NULL, mp->storage, &retval, 1, args TSRMLS_CC) == SUCCESS) {
+        if (EG(exception)) {
+            result = FAILURE;
+        } else if (Z_TYPE(retval) == IS_STRING && Z_STRLEN(retval) > 0) {
+            if (php_check_open_basedir(Z_STRVAL(retval) TSRMLS_CC)) {
+                result = FAILURE;
+            } else {
+                mp->dest_filename = estrndup(Z_STRVAL(retval), Z_STRLEN(retval));
+            }
+        } else if (Z_TYPE(retval) != IS_NULL && Z_TYPE(retval) != IS_BOOL) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "File upload error - storage handler must return a path or null");
+            result = FAILURE;
+        }
+        zval_dtor(&retval);
+    } else {
+        result = FAILURE;
+    }
+    zval_ptr_dtor(&part);
 
-    const char * delim = my_memmem(in, inlen, (const char *) boundary_val, boundary_val_len );
+    if (result == FAILURE) {
+        mp->sink = MULTIPART_SINK_SKIP;
+        mp->state = MULTIPART_ERROR;
+        mp->status = 500;
+    }
+}
 
-    MAKE_STD_ZVAL(*files);
-    array_init(*files);
+/**
+ * Part headers are received, decide where the part data goes
+ */
+static int multipart_begin_part(struct php_can_multipart *mp TSRMLS_DC)
+{
+    char *cd = NULL, *type = NULL, *pair, *line, *next, *eol;
 
-    while( delim ) {
+    multipart_reset_part(mp TSRMLS_CC);
+    smart_str_0(&mp->headers);
 
-        size_t part_len;
-        const char * part = delim + boundary_val_len;
-        inlen -= ( part - in );
-        in = part;
+    for (line = mp->headers.c; line != NULL && *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        if ((eol = strchr(line, '\r')) != NULL) {
+            *eol = '\0';
+        }
+        if (!strncasecmp(line, "Content-Disposition:", sizeof("Content-Disposition:") - 1)) {
+            cd = line + sizeof("Content-Disposition:") - 1;
+        } else if (!strncasecmp(line, "Content-Type:", sizeof("Content-Type:") - 1)) {
+            type = line + sizeof("Content-Type:") - 1;
+            while (isspace(*type)) ++type;
+        }
+    }
 
-        delim = my_memmem(in, inlen, (const char *) boundary_val, boundary_val_len );
-        part_len = delim ? (size_t)( delim - part ) : inlen;
+    if (cd == NULL) {
+        // part without disposition is skipped
+        return SUCCESS;
+    }
 
-        if( part_len ) {
+    while (isspace(*cd)) ++cd;
 
-            char *cd   = NULL,
-                 *pair = NULL,
-                 *text = estrndup(part, part_len);
+    while (*cd && (pair = getword(&cd, ';'))) {
 
-            if ( (cd = strstr(text, "Content-Disposition:")) != NULL) {
+        char *key  = NULL,
+             *word = pair;
 
-                char *param    = NULL,
-                     *value    = NULL,
-                     *filename = NULL;
+        while (isspace(*cd)) ++cd;
 
-                cd = strchr(text, ':');
-                cd++;
-                while (isspace(*cd)) ++cd;
+        if (strchr(pair, '=')) {
+            key = getword(&pair, '=');
+            if (!strcasecmp(key, "name")) {
+                if (mp->name) {
+                    efree(mp->name);
+                }
+                mp->name = getword_conf(&pair TSRMLS_CC);
+            } else if (!strcasecmp(key, "filename")) {
+                if (mp->filename) {
+                    efree(mp->filename);
+                }
+                mp->filename = getword_conf(&pair TSRMLS_CC);
+            }
+        }
 
-                while (*cd && (pair = getword(&cd, ';'))) {
+        if (key) {
+            efree(key);
+        }
+        efree(word);
+    }
 
-                    char *key  = NULL,
-                         *word = pair;
+    // no name="" and no filename="" found
+    if (!mp->name && !mp->filename) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "File Upload Mime headers garbled");
+        return FAILURE;
+    }
 
-                    while (isspace(*cd)) ++cd;
+    if (!mp->filename) {
+        mp->sink = MULTIPART_SINK_FIELD;
+    } else if (!PG(file_uploads)) {
+        // If file_uploads=off, skip the file part
+        mp->sink = MULTIPART_SINK_SKIP;
+    } else if (mp->upload_cnt <= 0) {
+        mp->sink = MULTIPART_SINK_SKIP;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING,
+            "Maximum number of allowable file uploads has been exceeded");
+    } else {
+        mp->sink = MULTIPART_SINK_FILE;
+        if (type != NULL && *type) {
+            mp->content_type = estrdup(type);
+        }
+        if (mp->storage != NULL) {
+            multipart_storage(mp TSRMLS_CC);
+        }
+    }
+    return SUCCESS;
+}
 
-                    if (strchr(pair, '=')) {
-                        key = getword(&pair, '=');
-                        if (!strcasecmp(key, "name")) {
-                            if (param) {
-                                efree(param);
-                            }
-                            param = getword_conf(&pair TSRMLS_CC);
-                        } else if (!strcasecmp(key, "filename")) {
-                            if (filename) {
-                                efree(filename);
-                            }
-                            filename = getword_conf(&pair TSRMLS_CC);
-                        }
-                    }
+/**
+ * Part delimiter is found, register received field or file
+ */
+static void multipart_end_part(struct php_can_multipart *mp TSRMLS_DC)
+{
+    if (mp->sink == MULTIPART_SINK_FIELD) {
 
-                    if (key) {
-                        efree(key);
+        smart_str_0(&mp->value);
+        if (mp->value.c == NULL) {
+            add_assoc_stringl(mp->post, mp->name, "", 0, 1);
+        } else {
+            // remove null bytes from the value
+            char *src = mp->value.c, *dst, *end = src + mp->value.len;
+            if ((dst = memchr(src, '\0', mp->value.len)) != NULL) {
+                for (src = dst; src < end; src++) {
+                    if (*src != '\0') {
+                        *dst++ = *src;
                     }
-                    efree(word);
                 }
+                mp->value.len = dst - mp->value.c;
+                *dst = '\0';
+            }
+            add_assoc_stringl(mp->post, mp->name, mp->value.c, mp->value.len, 0);
+            mp->value.c = NULL;
+            mp->value.len = mp->value.a = 0;
+        }
 
-                // If file_uploads=off, skip the file part
-                if (!PG(file_uploads)) {
-                    skip_upload = 1;
-                } else if (upload_cnt <= 0) {
-                    skip_upload = 1;
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                        "Maximum number of allowable file uploads has been exceeded");
-                }
+    } else if (mp->sink == MULTIPART_SINK_FILE && (mp->fd != -1 || mp->value.len > 0)) {
 
-                if (skip_upload) {
-                    if (param) efree(param);
-                    if (filename) efree(filename);
-                    efree(text);
-                    continue;
-                }
+        char *s, *tmp = NULL, *name = mp->name, anon[MAX_SIZE_ANONNAME];
+        zval *file;
 
-                // no name="" and no filename="" found
-                if (!param && !filename) {
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                        "File Upload Mime headers garbled");
-                    efree(text);
-                    efree(boundary_val);
-                    return;
-                }
+        if (mp->fd != -1) {
+            close(mp->fd);
+            mp->fd = -1;
+        }
+        mp->upload_cnt--;
 
-                if (!filename && param) {
+        if (mp->stored && VCWD_RENAME(mp->temp_filename, mp->dest_filename) != 0) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                "File upload error - unable to move file to '%s'", mp->dest_filename);
+            multipart_reset_part(mp TSRMLS_CC);
+            return;
+        }
 
-                    if ((value = strstr( text, "\r\n\r\n" )) != NULL) {
-                        value += 4; // skip CRLFs at the beginning
-                        int value_len = part_len - ( value - text ) - 2;
-                        add_assoc_stringl(post, param, value, value_len, 1);
-                    }
-                    efree(param);
-                    param = NULL;
-                }
+        s = strrchr(mp->filename, '\\');
+        if ((tmp = strrchr(mp->filename, '/')) > s) {
+            s = tmp;
+        }
 
-                if (filename) {
+        if (!name) {
+            snprintf(anon, MAX_SIZE_ANONNAME, "%u", (unsigned)mp->anonindex++);
+            name = anon;
+        }
 
-                    char *s, *tmp=NULL;
-                    s = strrchr(filename, '\\');
-                    if ((tmp = strrchr(filename, '/')) > s) {
-                        s = tmp;
-                    }
+        MAKE_STD_ZVAL(file);
+        array_init(file);
 
-                    if (!param) {
-                        is_anonymous = 1;
-                        param = emalloc(MAX_SIZE_ANONNAME);
-                        snprintf(param, MAX_SIZE_ANONNAME, "%u", anonindex++);
-                    } else {
-                        is_anonymous = 0;
-                    }
+        add_assoc_string(file, "name", name, 1);
+        if (s && s > mp->filename) {
+            add_assoc_string(file, "filename", s+1, 1);
+        } else {
+            add_assoc_string(file, "filename", mp->filename, 1);
+        }
+        if (mp->content_type) {
+            add_assoc_string(file, "type", mp->content_type, 1);
+        }
+        add_assoc_long(  file, "filesize", mp->file_size);
+        if (mp->stored) {
+            add_assoc_string(file, "path", mp->dest_filename, 0);
+            mp->dest_filename = NULL;
+            efree(mp->temp_filename);
+            mp->temp_filename = NULL;
+        } else if (mp->temp_filename) {
+            // only the temporary file itself is removed, never a path taken from the values
+            add_assoc_string(file, "tmp_name", mp->temp_filename, 1);
+            if (*mp->temp_files == NULL) {
+                ALLOC_HASHTABLE(*mp->temp_files);
+                zend_hash_init(*mp->temp_files, 4, NULL, temp_file_dtor, 0);
+            }
+            zend_hash_next_index_insert(*mp->temp_files, &mp->temp_filename, sizeof(char *), NULL);
+            mp->temp_filename = NULL;
+        } else {
+            // small file never touched the disk
+            smart_str_0(&mp->value);
+            add_assoc_stringl(file, "content", mp->value.c, mp->value.len, 0);
+            mp->value.c = NULL;
+            mp->value.len = mp->value.a = 0;
+        }
 
+        add_next_index_zval(mp->files, file);
+    }
 
-                    if ((value = strstr( text, "\r\n\r\n" )) != NULL) {
+    multipart_reset_part(mp TSRMLS_CC);
+}
 
-                        value += 4; // skip CRLFs at the beginning
-                        int value_len = part_len - ( value - text ) - 2;
+/**
+ * Consume part data up to the delimiter, returns number of bytes consumed
+ */
+static size_t multipart_data(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC)
+{
+    const char *found;
+    size_t n, k, start;
+
+    if (mp->held_len > 0) {
+        // held bytes are the beginning of the delimiter, check if data completes it
+        n = mp->delim_len - mp->held_len;
+        if (n > len) {
+            n = len;
+        }
+        if (!memcmp(data, mp->delim + mp->held_len, n)) {
+            if (mp->held_len + n == mp->delim_len) {
+                mp->held_len = 0;
+                if (mp->state == MULTIPART_DATA) {
+                    multipart_end_part(mp TSRMLS_CC);
+                }
+                mp->state = MULTIPART_BOUNDARY;
+            } else {
+                memcpy(mp->held + mp->held_len, data, n);
+                mp->held_len += n;
+            }
+            return n;
+        }
+        // not a delimiter, release held bytes up to the next possible delimiter start
+        for (k = 1; k < mp->held_len; k++) {
+            if (!memcmp(mp->held + k, mp->delim, mp->held_len - k)) {
+                break;
+            }
+        }
+        if (mp->state == MULTIPART_DATA) {
+            multipart_emit(mp, mp->held, k TSRMLS_CC);
+        }
+        memmove(mp->held, mp->held + k, mp->held_len - k);
+        mp->held_len -= k;
+        return 0;
+    }
 
-                        if (value_len > 0) {
+    if ((found = multipart_find(mp, data, len)) != NULL) {
+        if (mp->state == MULTIPART_DATA) {
+            multipart_emit(mp, data, found - data TSRMLS_CC);
+            multipart_end_part(mp TSRMLS_CC);
+        }
+        mp->state = MULTIPART_BOUNDARY;
+        return found - data + mp->delim_len;
+    }
 
-                            fd = php_open_temporary_fd_ex(PG(upload_tmp_dir), "phpcan", &temp_filename, 1 TSRMLS_CC);
-                            if (fd == -1) { // create temporary file failed
-                                php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                    "File upload error - unable to create a temporary file");
-                            } else {
+    // hold the tail which may be the beginning of the delimiter, the next
+    // chunk resumes from here and nothing before it is scanned again
+    start = len > mp->delim_len - 1 ? len - (mp->delim_len - 1) : 0;
+    while (start < len) {
+        if ((found = memchr(data + start, '\r', len - start)) == NULL) {
+            start = len;
+            break;
+        }
+        start = found - data;
+        if (!memcmp(found, mp->delim, len - start)) {
+            break;
+        }
+        start++;
+    }
+    if (mp->state == MULTIPART_DATA) {
+        multipart_emit(mp, data, start TSRMLS_CC);
+    }
+    memcpy(mp->held, data + start, len - start);
+    mp->held_len = len - start;
+    return len;
+}
 
-                                size_t wlen = write(fd, value, value_len);
-                                if (wlen == -1) { // write failed
-                                    php_error_docref(NULL TSRMLS_CC, E_WARNING,
-                                        "File upload error - unable to write to a temporary file");
-                                } else {
+/**
+ * Consume part headers, returns number of bytes consumed
+ */
+static size_t multipart_headers(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC)
+{
+    const char *eol = memchr(data, '\n', len);
+    size_t n = eol ? (size_t)(eol - data + 1) : len;
+
+    if (mp->headers.len + n > MAX_SIZE_PARTHEADERS) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "File Upload Mime headers garbled");
+        mp->state = MULTIPART_ERROR;
+        mp->status = 400;
+        return len;
+    }
+    smart_str_appendl(&mp->headers, data, n);
+
+    if (eol) {
+        size_t line_len = mp->headers.len - mp->line_start;
+        if (line_len <= 2 && (line_len == 1 || mp->headers.c[mp->line_start] == '\r')) {
+            // empty line terminates the headers
+            mp->state = MULTIPART_DATA;
+            if (multipart_begin_part(mp TSRMLS_CC) == FAILURE) {
+                mp->state = MULTIPART_ERROR;
+                mp->status = 400;
+            }
+            mp->headers.len = 0;
+            mp->line_start = 0;
+        } else {
+            mp->line_start = mp->headers.len;
+        }
+    }
+    return n;
+}
 
-                                    zval *file;
-                                    MAKE_STD_ZVAL(file);
-                                    ALLOC_HASHTABLE(Z_ARRVAL_P(file));
-                                    zend_hash_init(Z_ARRVAL_P(file), 4, NULL, (dtor_func_t)  unlink_filename, 0);
-                                    Z_TYPE_P(file) = IS_ARRAY;
+/**
+ * Create parser for the multipart/form-data body, fields are added to the post
+ * array and files to the files array, temporary files are added to temp_files,
+ * upload options are taken from the route if given, NULL is returned if boundary is invalid
+ */
+struct php_can_multipart *php_can_multipart_new(const char *content_type, struct php_can_server_route *route, 
+        zval *post, zval *files, HashTable **temp_files TSRMLS_DC)
+{
+    struct php_can_multipart *mp;
+    char *boundary, *max_uploads = INI_STR("max_file_uploads");
+    size_t boundary_len, i;
 
-                                    add_assoc_string(file, "name", param, 1);
-                                    if (s && s > filename) {
-                                        add_assoc_string(file, "filename", s+1, 1);
-                                    } else {
-                                        add_assoc_string(file, "filename", filename, 1);
-                                    }
-                                    add_assoc_long(  file, "filesize", wlen);
-                                    add_assoc_string(file, "tmp_name", temp_filename, 1);
+    if (multipart_boundary(content_type, &boundary, &boundary_len) != 0) {
+        return NULL;
+    }
 
-                                    add_next_index_zval(*files, file);
+    mp = ecalloc(1, sizeof(*mp));
+    mp->state = MULTIPART_PREAMBLE;
+    mp->delim_len = spprintf(&mp->delim, 0, "\r\n--%s", boundary);
+    mp->held = emalloc(mp->delim_len);
+    for (i = 0; i < 256; i++) {
+        mp->skip[i] = mp->delim_len;
+    }
+    for (i = 0; i < mp->delim_len - 1; i++) {
+        mp->skip[(unsigned char)mp->delim[i]] = mp->delim_len - 1 - i;
+    }
+    mp->fd = -1;
+    mp->sink = MULTIPART_SINK_SKIP;
+    mp->post = post;
+    mp->files = files;
+    mp->temp_files = temp_files;
+    if (route != NULL) {
+        mp->memory_limit = route->upload_memory_limit;
+        mp->max_filesize = route->upload_max_filesize;
+        mp->max_fieldsize = route->field_max_size;
+        mp->storage = route->storage_handler;
+    } else {
+        mp->max_filesize = PG(upload_max_filesize);
+        mp->max_fieldsize = PHP_CAN_SERVER_FIELD_MAX_SIZE;
+    }
+    if (max_uploads && *max_uploads) {
+        mp->upload_cnt = atoi(max_uploads);
+    }
+    efree(boundary);
 
-                                }
+    // the first delimiter is not preceded by CRLF
+    php_can_multipart_feed(mp, "\r\n", 2 TSRMLS_CC);
+    return mp;
+}
 
-                                efree(temp_filename);
-                                close(fd);
-                            }
-                        }
-                    }
+/**
+ * Feed next chunk of the body to the parser, chunk is not kept
+ */
+int php_can_multipart_feed(struct php_can_multipart *mp, const char *data, size_t len TSRMLS_DC)
+{
+    const char *eol;
+    size_t n;
+
+    while (len > 0) {
+        switch (mp->state) {
+            case MULTIPART_PREAMBLE:
+            case MULTIPART_DATA:
+                n = multipart_data(mp, data, len TSRMLS_CC);
+                break;
+
+            case MULTIPART_BOUNDARY:
+                // either "--" of the close delimiter or transport padding follows
+                mp->state = *data == '-' ? MULTIPART_BOUNDARY_DASH : MULTIPART_BOUNDARY_LWS;
+                n = *data == '-' ? 1 : 0;
+                break;
+
+            case MULTIPART_BOUNDARY_DASH:
+                mp->state = *data == '-' ? MULTIPART_EPILOGUE : MULTIPART_BOUNDARY_LWS;
+                n = 1;
+                break;
+
+            case MULTIPART_BOUNDARY_LWS:
+                eol = memchr(data, '\n', len);
+                if (eol) {
+                    mp->state = MULTIPART_HEADERS;
+                }
+                n = eol ? (size_t)(eol - data + 1) : len;
+                break;
 
-                    efree(filename);
-                    filename = NULL;
+            case MULTIPART_HEADERS:
+                n = multipart_headers(mp, data, len TSRMLS_CC);
+                break;
 
-                    efree(param);
-                    param = NULL;
-                }
+            case MULTIPART_EPILOGUE:
+                return SUCCESS;
 
-            }
-            efree(text);
+            default:
+                return FAILURE;
+        }
+        data += n;
+        len -= n;
+        if (mp->status != 0) {
+            // body is refused, the rest of it is not parsed
+            mp->state = MULTIPART_ERROR;
+            return FAILURE;
         }
     }
-    efree(boundary_val);
+    return SUCCESS;
+}
+
+/**
+ * Feed buffered body to the parser chunk by chunk, buffer is left untouched
+ */
+int php_can_multipart_feed_buffer(struct php_can_multipart *mp, struct evbuffer *buffer TSRMLS_DC)
+{
+    struct evbuffer_iovec *vec;
+    int i, n, retval = SUCCESS;
+
+    n = evbuffer_peek(buffer, -1, NULL, NULL, 0);
+    if (n <= 0) {
+        return SUCCESS;
+    }
+
+    vec = safe_emalloc(n, sizeof(*vec), 0);
+    n = evbuffer_peek(buffer, -1, NULL, vec, n);
+    for (i = 0; i < n && retval == SUCCESS; i++) {
+        retval = php_can_multipart_feed(mp, vec[i].iov_base, vec[i].iov_len TSRMLS_CC);
+    }
+    efree(vec);
+    return retval;
+}
+
+/**
+ * Get HTTP status of the parsing error: 413 if a file exceeds the size limit,
+ * 400 if the body is malformed, 500 if the storage handler failed, 0 otherwise
+ */
+long php_can_multipart_status(struct php_can_multipart *mp)
+{
+    return mp->status;
+}
+
+/**
+ * Body is complete, part which was not terminated by the delimiter is dropped
+ * and the body is malformed, FAILURE is returned then
+ */
+int php_can_multipart_finish(struct php_can_multipart *mp TSRMLS_DC)
+{
+    int complete = mp->state == MULTIPART_EPILOGUE;
+
+    multipart_reset_part(mp TSRMLS_CC);
+    mp->state = MULTIPART_EPILOGUE;
+    if (!complete && mp->status == 0) {
+        mp->status = 400;
+    }
+    return complete ? SUCCESS : FAILURE;
+}
+
+/**
+ * Destroy parser, temporary file of unfinished part is removed
+ */
+void php_can_multipart_free(struct php_can_multipart *mp TSRMLS_DC)
+{
+    multipart_reset_part(mp TSRMLS_CC);
+    smart_str_free(&mp->headers);
+    efree(mp->delim);
+    efree(mp->held);
+    efree(mp);
+}
+
+/**
+ * Parse buffered multipart body, returns HTTP status of the parsing error or 0
+ */
+long php_can_parse_multipart(const char* content_type, struct php_can_server_route *route, 
+        struct evbuffer* buffer, zval* post, zval** files, HashTable **temp_files TSRMLS_DC)
+{
+    struct php_can_multipart *mp;
+    char *boundary;
+    size_t boundary_len;
+    long status;
+
+    switch (multipart_boundary(content_type, &boundary, &boundary_len)) {
+        case -1:
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Missing boundary in multipart/form-data POST data");
+            return 0;
+        case -2:
+            php_can_throw_exception(
+                ce_can_LogicException TSRMLS_CC,
+                "Invalid boundary in multipart/form-data POST data"
+            );
+            return 0;
+    }
+    efree(boundary);
+
+    MAKE_STD_ZVAL(*files);
+    array_init(*files);
+
+    mp = php_can_multipart_new(content_type, route, post, *files, temp_files TSRMLS_CC);
+    php_can_multipart_feed_buffer(mp, buffer TSRMLS_CC);
+    php_can_multipart_finish(mp TSRMLS_CC);
+    status = php_can_multipart_status(mp);
+    php_can_multipart_free(mp TSRMLS_CC);
+    return status;
+}
+
+/**
+ * Remove temporary files of the uploads
+ */
+void php_can_multipart_temp_files_free(HashTable **temp_files)
+{
+    if (*temp_files) {
+        zend_hash_destroy(*temp_files);
+        FREE_HASHTABLE(*temp_files);
+        *temp_files = NULL;
+    }
 }
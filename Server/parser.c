@@ -0,0 +1,571 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 5.3                                                      |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2002-2011 Dmitri Vinogradov                            |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Authors: Dmitri Vinogradov <dmitri.vinogradov@gmail.com>             |
+  +----------------------------------------------------------------------+
+*/
+
+#include "Server.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Variable names up to this length are decoded on the stack */
+#define PHP_CAN_PARSER_NAME_LEN 256
+
+static const signed char hexdigits[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+/**
+ * Find the first byte which needs decoding ('%', '+' or null byte)
+ */
+static inline const char *find_escape(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i pct  = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i nul  = _mm_setzero_si128();
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)),
+            _mm_cmpeq_epi8(v, nul)
+        ));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        if (*p == '%' || *p == '+' || *p == '\0') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * Find the first separator
+ */
+static inline const char *find_separator(const char *p, const char *end, const char *separators, int separators_len)
+{
+    if (separators_len == 1) {
+        return memchr(p, separators[0], end - p);
+    }
+    while (p < end) {
+        if (memchr(separators, *p, separators_len)) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * Decode percent escapes and '+' of src into dst, null bytes are dropped,
+ * returns length of the decoded string. dst must be able to hold len bytes
+ */
+size_t php_can_url_decode(char *dst, const char *src, size_t len)
+{
+    const char *end = src + len, *esc;
+    char *out = dst;
+
+    while (src < end && (esc = find_escape(src, end)) != NULL) {
+        // copy the plain run at once
+        memcpy(out, src, esc - src);
+        out += esc - src;
+        src = esc;
+        if (*src == '+') {
+            *out++ = ' ';
+            src++;
+        } else if (*src == '%') {
+            if (end - src > 2 && hexdigits[(unsigned char)src[1]] >= 0 && hexdigits[(unsigned char)src[2]] >= 0) {
+                char c = (char)((hexdigits[(unsigned char)src[1]] << 4) | hexdigits[(unsigned char)src[2]]);
+                if (c != '\0') {
+                    *out++ = c;
+                }
+                src += 3;
+            } else {
+                *out++ = *src++;
+            }
+        } else {
+            // null byte
+            src++;
+        }
+    }
+    memcpy(out, src, end - src);
+    out += end - src;
+    return out - dst;
+}
+
+/**
+ * Register variable in the array, the value is owned by the array afterwards.
+ * Supports the same name[]/name[key] syntax as php_register_variable_ex()
+ */
+static void register_variable(char *var, zval *val, zval *array TSRMLS_DC)
+{
+    char *p, *ip = NULL, *index;
+    int var_len, index_len, nest_level = 0;
+    zend_bool is_array = 0;
+    HashTable *symtable = Z_ARRVAL_P(array);
+    zval *element, **element_p;
+
+    // ignore leading spaces in the variable name
+    while (*var == ' ') {
+        var++;
+    }
+
+    // ensure that we don't have spaces or dots in the variable name
+    for (p = var; *p; p++) {
+        if (*p == ' ' || *p == '.') {
+            *p = '_';
+        } else if (*p == '[') {
+            is_array = 1;
+            ip = p;
+            *p = '\0';
+            break;
+        }
+    }
+    var_len = p - var;
+
+    if (var_len == 0) {
+        zval_dtor(val);
+        return;
+    }
+
+    index = var;
+    index_len = var_len;
+
+    if (is_array) {
+        while (1) {
+            char *index_s;
+            int new_index_len = 0;
+
+            if (++nest_level > PG(max_input_nesting_level)) {
+                // too many levels of nesting, drop the whole variable
+                zend_symtable_del(Z_ARRVAL_P(array), var, var_len + 1);
+                zval_dtor(val);
+                return;
+            }
+
+            ip++;
+            index_s = ip;
+            if (*ip == ' ') {
+                ip++;
+            }
+            if (*ip == ']') {
+                index_s = NULL;
+            } else {
+                ip = strchr(ip, ']');
+                if (!ip) {
+                    // variables cannot contain '[' in their names, so we replace the character with a '_'
+                    *(index_s - 1) = '_';
+                    index_len = index ? strlen(index) : 0;
+                    goto plain_var;
+                }
+                *ip = '\0';
+                new_index_len = strlen(index_s);
+            }
+
+            if (!index) {
+                MAKE_STD_ZVAL(element);
+                array_init(element);
+                if (zend_hash_next_index_insert(symtable, &element, sizeof(zval *), (void **)&element_p) == FAILURE) {
+                    zval_ptr_dtor(&element);
+                    zval_dtor(val);
+                    return;
+                }
+            } else if (zend_symtable_find(symtable, index, index_len + 1, (void **)&element_p) == FAILURE
+                    || Z_TYPE_PP(element_p) != IS_ARRAY) {
+                MAKE_STD_ZVAL(element);
+                array_init(element);
+                zend_symtable_update(symtable, index, index_len + 1, &element, sizeof(zval *), (void **)&element_p);
+            }
+            symtable = Z_ARRVAL_PP(element_p);
+            index = index_s;
+            index_len = new_index_len;
+
+            ip++;
+            if (*ip != '[') {
+                break;
+            }
+            *ip = '\0';
+        }
+    }
+
+plain_var:
+    MAKE_STD_ZVAL(element);
+    element->value = val->value;
+    Z_TYPE_P(element) = Z_TYPE_P(val);
+    if (!index) {
+        if (zend_hash_next_index_insert(symtable, &element, sizeof(zval *), NULL) == FAILURE) {
+            zval_ptr_dtor(&element);
+        }
+    } else {
+        zend_symtable_update(symtable, index, index_len + 1, &element, sizeof(zval *), NULL);
+    }
+}
+
+/**
+ * Parse query string or application/x-www-form-urlencoded body into the array
+ * in a single pass: pairs are split, decoded and registered without copying
+ * the input, values without escapes are duplicated at once. Every pair goes
+ * through the SAPI input filter as PARSE_STRING like php_default_treat_data()
+ * did, other arguments make ext/filter register the pair in the superglobals
+ */
+void php_can_parse_urlencoded(const char *str, size_t len, zval *array TSRMLS_DC)
+{
+    const char *p = str, *end = str + len, *pair_end, *eq;
+    const char *separators = PG(arg_separator).input;
+    int separators_len = strlen(separators);
+    char name_buf[PHP_CAN_PARSER_NAME_LEN], *name;
+    size_t name_len;
+    unsigned int new_len;
+    long count = 0;
+    zval val;
+
+    while (p < end) {
+
+        pair_end = find_separator(p, end, separators, separators_len);
+        if (pair_end == NULL) {
+            pair_end = end;
+        }
+
+        if (pair_end > p) {
+
+#if PHP_VERSION_ID >= 50309
+            if (++count > PG(max_input_vars)) {
+                php_error_docref(NULL TSRMLS_CC, E_WARNING,
+                    "Input variables exceeded %ld. To increase the limit change max_input_vars in php.ini.",
+                    PG(max_input_vars));
+                break;
+            }
+#endif
+
+            eq = memchr(p, '=', pair_end - p);
+
+            // decode name, it is used as C string so null bytes terminate it
+            name_len = (eq ? eq : pair_end) - p;
+            name = name_len < sizeof(name_buf) ? name_buf : emalloc(name_len + 1);
+            memcpy(name, p, name_len);
+            name[php_url_decode(name, name_len)] = '\0';
+
+            // decode value straight into the final string
+            INIT_ZVAL(val);
+            if (eq == NULL || eq + 1 == pair_end) {
+                ZVAL_EMPTY_STRING(&val);
+            } else if (find_escape(eq + 1, pair_end) == NULL) {
+                ZVAL_STRINGL(&val, eq + 1, pair_end - (eq + 1), 1);
+            } else {
+                char *value = emalloc(pair_end - eq);
+                size_t value_len = php_can_url_decode(value, eq + 1, pair_end - (eq + 1));
+                value[value_len] = '\0';
+                ZVAL_STRINGL(&val, value, value_len, 0);
+            }
+
+            // filter may replace the value, e.g. with filter.default of ext/filter
+            if (sapi_module.input_filter(PARSE_STRING, name, &Z_STRVAL(val), Z_STRLEN(val), &new_len TSRMLS_CC)) {
+                Z_STRLEN(val) = new_len;
+                register_variable(name, &val, array TSRMLS_CC);
+            } else {
+                zval_dtor(&val);
+            }
+
+            if (name != name_buf) {
+                efree(name);
+            }
+        }
+
+        p = pair_end + 1;
+    }
+}
+
+/**
+ * Split next cookie off the Cookie header, returns 0 if there are no more cookies.
+ * Leading whitespace of the name is skipped, value is NULL for cookies without '='
+ */
+static int next_cookie(const char **p, const char *end, 
+        const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+    const char *pair_end, *eq;
+
+    while (*p < end) {
+        pair_end = memchr(*p, ';', end - *p);
+        if (pair_end == NULL) {
+            pair_end = end;
+        }
+
+        *name = *p;
+        *p = pair_end + 1;
+
+        while (*name < pair_end && isspace((unsigned char)**name)) {
+            (*name)++;
+        }
+        eq = memchr(*name, '=', pair_end - *name);
+        if (*name == pair_end || *name == eq) {
+            // empty name
+            continue;
+        }
+
+        if (eq != NULL) {
+            *name_len = eq - *name;
+            *value = eq + 1;
+            *value_len = pair_end - *value;
+        } else {
+            *name_len = pair_end - *name;
+            *value = NULL;
+            *value_len = 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Decode cookie value straight into the zval
+ */
+static void cookie_value(zval *zv, const char *value, size_t value_len)
+{
+    if (value == NULL || value_len == 0) {
+        ZVAL_EMPTY_STRING(zv);
+    } else if (find_escape(value, value + value_len) == NULL) {
+        ZVAL_STRINGL(zv, value, value_len, 1);
+    } else {
+        char *str = emalloc(value_len + 1);
+        size_t str_len = php_can_url_decode(str, value, value_len);
+        str[str_len] = '\0';
+        ZVAL_STRINGL(zv, str, str_len, 0);
+    }
+}
+
+/**
+ * Decode cookie name into the buffer, if the buffer is too small a new one
+ * is allocated. Name is used as C string so null bytes terminate it
+ */
+static char *cookie_name(char *buf, size_t buf_len, const char *name, size_t name_len)
+{
+    char *str = name_len < buf_len ? buf : emalloc(name_len + 1);
+    memcpy(str, name, name_len);
+    str[php_url_decode(str, name_len)] = '\0';
+    return str;
+}
+
+/**
+ * Parse Cookie header into the array in a single pass, names and values are
+ * decoded straight into the hash keys and value strings, numeric names stay string keys
+ */
+void php_can_parse_cookies(const char *str, size_t len, zval *array TSRMLS_DC)
+{
+    const char *p = str, *end = str + len, *name, *value;
+    size_t name_len, value_len;
+    char name_buf[PHP_CAN_PARSER_NAME_LEN], *key;
+    zval *zv;
+
+    while (next_cookie(&p, end, &name, &name_len, &value, &value_len)) {
+        key = cookie_name(name_buf, sizeof(name_buf), name, name_len);
+        if (*key != '\0') {
+            MAKE_STD_ZVAL(zv);
+            cookie_value(zv, value, value_len);
+            zend_hash_update(Z_ARRVAL_P(array), key, strlen(key) + 1, &zv, sizeof(zval *), NULL);
+        }
+        if (key != name_buf) {
+            efree(key);
+        }
+    }
+}
+
+/**
+ * Find single cookie in the Cookie header without parsing the other ones,
+ * the last cookie with the given name wins as in php_can_parse_cookies()
+ */
+int php_can_find_cookie(const char *str, size_t len, const char *cookie, size_t cookie_len, zval *retval TSRMLS_DC)
+{
+    const char *p = str, *end = str + len, *name, *value, *found = NULL;
+    size_t name_len, value_len, found_len = 0;
+    char name_buf[PHP_CAN_PARSER_NAME_LEN], *key;
+
+    while (next_cookie(&p, end, &name, &name_len, &value, &value_len)) {
+        if (memchr(name, '%', name_len) == NULL && memchr(name, '+', name_len) == NULL) {
+            // name has nothing to decode, compare it as is
+            if (name_len != cookie_len || memcmp(name, cookie, cookie_len) != 0) {
+                continue;
+            }
+        } else {
+            key = cookie_name(name_buf, sizeof(name_buf), name, name_len);
+            int match = strlen(key) == cookie_len && memcmp(key, cookie, cookie_len) == 0;
+            if (key != name_buf) {
+                efree(key);
+            }
+            if (!match) {
+                continue;
+            }
+        }
+        found = value ? value : "";
+        found_len = value_len;
+    }
+
+    if (found == NULL) {
+        return FAILURE;
+    }
+    cookie_value(retval, found, found_len);
+    return SUCCESS;
+}
+
+/**
+ * Check JSON nesting depth without decoding, depth is counted the way
+ * the json extension counts it: scalar document has depth of 1
+ */
+int php_can_json_depth_exceeds(const char *str, size_t len, long depth)
+{
+    const char *p = str, *end = str + len;
+    long level = 1;
+
+    while (p < end) {
+        switch (*p++) {
+            case '"':
+                // skip string contents, quotes and brackets inside do not count
+                while (p < end && *p != '"') {
+                    if (*p == '\\') {
+                        p++;
+                    }
+                    p++;
+                }
+                p++;
+                break;
+            case '[':
+            case '{':
+                if (++level > depth) {
+                    return 1;
+                }
+                break;
+            case ']':
+            case '}':
+                level--;
+                break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check if any entity tag of If-None-Match header matches the ETag,
+ * weak comparison is used, so W/ prefixes are ignored
+ */
+int php_can_etag_matches(const char *header, const char *etag)
+{
+    const char *p = header;
+    size_t etag_len;
+
+    if (etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;
+    }
+    etag_len = strlen(etag);
+
+    while (*p) {
+        const char *tag;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') {
+            return 1;
+        }
+        if (p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (*p != '"') {
+            // malformed tag, skip it
+            while (*p && *p != ',') p++;
+            continue;
+        }
+        tag = p++;
+        while (*p && *p != '"') p++;
+        if (*p == '"') {
+            p++;
+        }
+        if ((size_t)(p - tag) == etag_len && strncmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+        while (*p && *p != ',') p++;
+    }
+    return 0;
+}
+
+/**
+ * Check if the encoding is accepted by Accept-Encoding header: listed with non-zero
+ * quality or, if not listed, covered by the "*" coding with non-zero quality
+ */
+int php_can_accepts_encoding(const char *header, const char *coding)
+{
+    size_t len = strlen(coding);
+    const char *p = header;
+    int any = 0;
+
+    while (*p) {
+        const char *token;
+        int match, wildcard, refused = 0;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        token = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        match = (size_t)(p - token) == len && strncasecmp(token, coding, len) == 0;
+        wildcard = p - token == 1 && *token == '*';
+
+        // parameters of the coding, only q=0 is of interest
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    p += 2;
+                    if (*p == '0') {
+                        p++;
+                        if (*p == '.') {
+                            p++;
+                            while (*p == '0') p++;
+                        }
+                        refused = !(*p >= '1' && *p <= '9');
+                    }
+                }
+                continue;
+            }
+            p++;
+        }
+        if (match) {
+            return !refused;
+        }
+        if (wildcard) {
+            any = !refused;
+        }
+    }
+    return any;
+}
@@ -50,6 +50,48 @@ if test "$PHP_CAN" != "no"; then
     -L$LIBEVENT_DIR/$PHP_LIBDIR
   ])
 
+  PHP_CHECK_LIBRARY($LIBNAME,evhttp_set_newreqcb,
+  [
+    AC_DEFINE(HAVE_EVHTTP_SET_NEWREQCB,1,[Whether libevent is able to stream request bodies])
+  ],[
+  ],[
+    -L$LIBEVENT_DIR/$PHP_LIBDIR
+  ])
+
+  PHP_CHECK_LIBRARY($LIBNAME,evbuffer_file_segment_new,
+  [
+    AC_DEFINE(HAVE_EVBUFFER_FILE_SEGMENT,1,[Whether libevent is able to share file segments between buffers])
+  ],[
+  ],[
+    -L$LIBEVENT_DIR/$PHP_LIBDIR
+  ])
+
+  PHP_CHECK_LIBRARY($LIBNAME,evhttp_send_reply_chunk_with_cb,
+  [
+    AC_DEFINE(HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB,1,[Whether libevent reports written reply chunks])
+  ],[
+  ],[
+    -L$LIBEVENT_DIR/$PHP_LIBDIR
+  ])
+
+  PHP_CHECK_LIBRARY($LIBNAME,evbuffer_add_buffer_reference,
+  [
+    AC_DEFINE(HAVE_EVBUFFER_ADD_BUFFER_REFERENCE,1,[Whether libevent is able to share buffer contents without copying])
+  ],[
+  ],[
+    -L$LIBEVENT_DIR/$PHP_LIBDIR
+  ])
+
+  AC_CHECK_HEADERS([sys/inotify.h])
+
+  PHP_CHECK_LIBRARY(z,deflateInit2_,
+  [
+    PHP_ADD_LIBRARY(z, 1, CAN_SHARED_LIBADD)
+    AC_DEFINE(HAVE_CAN_ZLIB,1,[Whether zlib is available to compress responses])
+  ],[
+  ],[
+  ])
+
   PHP_ADD_EXTENSION_DEP(can, sockets, true)
   PHP_SUBST(CAN_SHARED_LIBADD)
   PHP_NEW_EXTENSION(can, \
@@ -60,5 +102,12 @@ if test "$PHP_CAN" != "no"; then
     Server/Route.c \
     Server/Request.c \
     Server/multipart.c \
+    Server/filecache.c \
+    Server/mimetypes.c \
+    Server/httpdate.c \
+    Server/cache.c \
+    Server/parser.c \
+    Server/hash.c \
+    Server/compress.c \
     , $ext_shared)
 fi